@@ -1,702 +1,5762 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
 #include <memory>
 #include <string>
 #include <type_traits>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <unordered_map>
-#include <sstream>
+#include <string_view>
+#include <charconv>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <array>
+#include <span>
+#include <bit>
+#include <utility>
+#include <optional>
+#include <random>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 #include <limits>
 class Character;
 class Weapon;
 class Potion;
 class Spell;
+class Narrator;
+class OutputSink;
+class VitalsStore;
+void healthChanged(const Character& character);
+void characterDied(const Character& character);
 
-class Narrator {
-    std::ofstream logFile;
-
-public:
-    Narrator(const std::string& filename) : logFile(filename) {
-        if (!logFile.is_open()) {
-            throw std::runtime_error("Failed to open log file.");
-        }
-    }
+// Services of the world the calling thread is simulating; see World.
+Narrator& narrator();
+OutputSink& console();
+VitalsStore& vitals();
 
-    void logEvent(const std::string& event) {
-        logFile << event << std::endl;
-    }
+// Dense index of a character, handed out once per name when it is first created.
+using CharacterId = uint32_t;
+constexpr CharacterId noCharacter = numeric_limits<CharacterId>::max();
 
-    ~Narrator() {
-        if (logFile.is_open()) {
-            logFile.close();
-        }
-    }
+// One incarnation of a character. Creating a name again starts a new generation of its
+// id (see VitalsStore), so a handle taken before that no longer resolves.
+struct CharacterHandle {
+    CharacterId id = noCharacter;
+    uint32_t generation = 0;
 };
 
-// Global Narrator instance
-Narrator narrator("story_log.txt");
+// Event metrics (see EventMetrics) are compiled in with -DEVENT_METRICS. Without it
+// every probe below is an empty inline function and costs nothing.
+#ifdef EVENT_METRICS
+constexpr bool eventMetrics = true;
+#else
+constexpr bool eventMetrics = false;
+#endif
 
+// How an event ended, as far as the simulation tells. The first failure noted while
+// an event runs is the one it is counted under.
+enum class EventOutcome : uint8_t {
+    Success,
+    UnknownCharacter,
+    ContainerFull,
+    NotAlive,
+    UnauthorizedTarget,
+    MissingItem,  // the weapon or spell named is not carried
+    Rejected,     // any other error the narrator reports, or an unrecognized line
+    Exception,    // the event was cut short by an exception
+    Count
+};
+void noteOutcome(EventOutcome outcome);
 
-class PhysicalItem {
-protected:
-    shared_ptr<Character> owner;
-    string name;
+// Adds the time until the end of its scope to total, in metrics builds only.
+class MetricsTimer {
+    chrono::nanoseconds* total;
+    chrono::steady_clock::time_point start;
 
 public:
-    PhysicalItem(string name, Character* owner, bool isUsableOnce)
-        : name(name), owner(owner), isUsableOnce(isUsableOnce) {}
+    explicit MetricsTimer(chrono::nanoseconds& total) : total(&total) {
+        if constexpr (eventMetrics) {
+            start = chrono::steady_clock::now();
+        }
+    }
 
-    virtual ~PhysicalItem() {}
-    bool isUsableOnce;
-    virtual void use(Character* user, Character* target) = 0;
-    string getName() const { return name; }
-    virtual void setup() = 0;
-protected:
-    virtual void print(ostream& os) const = 0;
-};
+    MetricsTimer(const MetricsTimer&) = delete;
+    MetricsTimer& operator=(const MetricsTimer&) = delete;
 
+    ~MetricsTimer() {
+        if constexpr (eventMetrics) {
+            *total += chrono::steady_clock::now() - start;
+        }
+    }
+};
 
+// Lock-free byte queue between exactly one producer thread and one consumer thread.
+// Positions grow monotonically; capacity is a power of two so wrapping is a mask.
+class SpscByteRing {
+    unique_ptr<char[]> data;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};  // written by the producer
+    alignas(64) atomic<size_t> tail{0};  // written by the consumer
 
-// Abstract Character class
-class Character {
-    friend class PhysicalItem;
-protected:
-    int healthPoints;
-    string name;
 public:
-    Character(string name, int hp) : name(name), healthPoints(hp) {}
-    virtual ~Character() {}
-
-    bool isAlive() const {
-        return healthPoints > 0;
+    explicit SpscByteRing(size_t capacityPow2)
+        : data(new char[capacityPow2]), mask(capacityPow2 - 1) {
+        assert(capacityPow2 && (capacityPow2 & mask) == 0);
     }
-    virtual std::string getType() const = 0;
-    virtual bool addItem(std::unique_ptr<PhysicalItem> item) = 0;
-    virtual bool canCarryWeapon() const { return true; }
-    virtual bool canCarryPotion() const { return true; }
-    virtual bool canCarrySpell() const { return true; }
-
-    string getName() const { return name; }
-    int getHP() const { return healthPoints; }
 
-    void heal(int healValue) {
-        healthPoints += healValue;
+    size_t capacity() const { return mask + 1; }
+    size_t size() const {
+        return head.load(memory_order_acquire) - tail.load(memory_order_acquire);
     }
+    size_t pushed() const { return head.load(memory_order_acquire); }  // bytes ever queued
 
-    virtual void print(ostream& os) const {
-        os << "Character: " << name << " HP: " << healthPoints << endl;
+    // Copies as much of bytes as fits and returns how many bytes were queued.
+    size_t push(string_view bytes) {
+        size_t h = head.load(memory_order_relaxed);
+        size_t n = min(bytes.size(), capacity() - (h - tail.load(memory_order_acquire)));
+        size_t offset = h & mask;
+        size_t first = min(n, capacity() - offset);
+        memcpy(data.get() + offset, bytes.data(), first);
+        memcpy(data.get(), bytes.data() + first, n - first);
+        head.store(h + n, memory_order_release);
+        return n;
     }
-    void takeDamage(int damage) {
-        if (healthPoints <= 0) {
-            return;
-        }
-        healthPoints -= damage;
-        if (healthPoints <= 0) {
-            healthPoints = 0;
 
-            narrator.logEvent(name + " has died.");
+    // Hands every queued byte to sink as at most two contiguous spans.
+    template<typename Sink>
+    size_t drain(Sink&& sink) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t n = head.load(memory_order_acquire) - t;
+        size_t offset = t & mask;
+        size_t first = min(n, capacity() - offset);
+        if (first) {
+            sink(string_view(data.get() + offset, first));
         }
+        if (n - first) {
+            sink(string_view(data.get(), n - first));
+        }
+        tail.store(t + n, memory_order_release);
+        return n;
     }
 };
-template<typename T>
-concept DerivedFromPhysicalItem = is_base_of<PhysicalItem, T>::value;
 
+// Bounded queue of values between exactly one producer thread and one consumer
+// thread. A full or empty queue blocks its side with atomic wait/notify; callers
+// batch their work so this happens rarely.
 template<typename T>
-class Container{
-private:
-    map<string, unique_ptr<T>> elements;
-    int maxCapacity;
-public:
+class SpscQueue {
+    unique_ptr<T[]> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};  // written by the producer
+    alignas(64) atomic<size_t> tail{0};  // written by the consumer
 
-};
-
-
-template<DerivedFromPhysicalItem T>
-class Container<T>{
-protected:
-    vector<T> elems;
 public:
-    Container(){
-        cout << "Base container created"<<endl;
+    explicit SpscQueue(size_t capacityPow2) : slots(new T[capacityPow2]), mask(capacityPow2 - 1) {
+        assert(capacityPow2 && (capacityPow2 & mask) == 0);
     }
-    ~Container(){
-        cout << "Base container destroyedwha" << endl;
+
+    void push(T value) {
+        size_t h = head.load(memory_order_relaxed);
+        for (size_t t; h - (t = tail.load(memory_order_acquire)) > mask;) {
+            tail.wait(t, memory_order_acquire);
+        }
+        slots[h & mask] = std::move(value);
+        head.store(h + 1, memory_order_release);
+        head.notify_one();
     }
-private:
-    map<string, unique_ptr<T>> elements;
-    int maxCapacity;
-public:
-    Container(int size) : maxCapacity(size) {}
 
-    bool addItem(unique_ptr<T> newItem) {
-        if (elements.size() >= maxCapacity) {
-            narrator.logEvent("Error caught: Container is full. Cannot add " + newItem->getName() + ".");
-            return false;
+    T pop() {
+        size_t t = tail.load(memory_order_relaxed);
+        for (size_t h; (h = head.load(memory_order_acquire)) == t;) {
+            head.wait(h, memory_order_acquire);
         }
-        elements.insert({newItem->getName(), std::move(newItem)});
-        return true;
+        T value = std::move(slots[t & mask]);
+        tail.store(t + 1, memory_order_release);
+        tail.notify_one();
+        return value;
+    }
+};
+
+// Waits, without locks so that a signal handler can use it, until done() holds or a
+// few seconds have passed.
+template<typename Done>
+bool spinUntil(Done&& done) {
+    for (int tries = 0; tries < 5000; ++tries) {
+        if (done()) {
+            return true;
+        }
+        timespec pause{0, 1000000};
+        nanosleep(&pause, nullptr);
+    }
+    return done();
+}
+
+// Variable-length integers of the binary formats: seven bits per byte, low bits
+// first, the high bit set on every byte but the last. Signed values are zigzagged.
+void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(char(value | 0x80));
+        value >>= 7;
     }
+    out.push_back(char(value));
+}
+
+constexpr uint64_t zigzag(int value) {
+    return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
 
+constexpr int unzigzag(uint64_t value) {
+    return int(uint32_t(value >> 1) ^ -uint32_t(value & 1));
+}
+
+// Bounds-checked cursor over varint encoded data; any read past the end fails it for
+// good.
+class ByteReader {
+    const char* pos;
+    const char* end;
+    bool failed = false;
+
+public:
+    explicit ByteReader(string_view data) : pos(data.data()), end(data.data() + data.size()) {}
 
-    T* getItem(const string& itemName) {
-        auto it = elements.find(itemName);
-        if (it != elements.end()) {
-            return it->second.get();
+    bool ok() const { return !failed; }
+    void fail() { failed = true; }
+    size_t remaining() const { return end - pos; }
+
+    uint8_t byte() {
+        if (pos == end) {
+            failed = true;
+            return 0;
         }
-        return nullptr;
+        return uint8_t(*pos++);
     }
 
-    bool removeItem(const string& itemName) {
-        return elements.erase(itemName) > 0;
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = byte();
+            value |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) {
+                return value;
+            }
+        }
+        failed = true;
+        return 0;
     }
 
-    void print() const {
-        for (const auto& pair : elements) {
-            pair.second->print(cout);
+    string_view bytes(size_t count) {
+        if (count > remaining()) {
+            failed = true;
+            return {};
         }
+        string_view result(pos, count);
+        pos += count;
+        return result;
     }
 };
 
+// Every line the story log knows. %c in a template stands for a character name, %s
+// for a string and %d for a number, filled from the arguments in order. The text log
+// renders lines as they happen; the binary log stores the kind and the raw arguments
+// and --decode-log renders them later with the same templates.
+enum class Story : uint8_t {
+    CannotCarry,
+    ItemNotSupported,
+    ContainerFull,
+    Died,
+    Attacks,
+    NotAliveToAttack,
+    MissingWeapon,
+    Casts,
+    UnauthorizedCast,
+    UserNotAlive,
+    TargetNotValid,
+    Heals,
+    AreaAmountInvalid,
+    UnknownAreaTarget,
+    NotAliveToDrink,
+    MissingPotion,
+    PoisonTick,
+    RegenerationTick,
+    EffectInvalid,
+    WaitInvalid,
+    MissingSpell,
+    Count
+};
 
+constexpr string_view storyTemplates[] = {
+    "Error caught: %c can't carry %s.",
+    "Error caught: Item type not supported for %c.",
+    "Error caught: Container is full. Cannot add %s.",
+    "%c has died.",
+    "%c attacks %c with %s, dealing %d damage.",
+    "Error caught: %c is not alive to perform an attack.",
+    "Error caught: %c doesn't own the weapon %s.",
+    "%c casts %s on %c.",
+    "%c attempted to cast %s on an unauthorized target: %c.",
+    "Error: User is not alive or does not exist.",
+    "Error: Target is not valid or not alive.",
+    "%c uses %s on %c, healing %d HP.",
+    "Error caught: area effect amount must be positive.",
+    "Error caught: unknown area effect target %s.",
+    "Error caught: %c is not alive to drink a potion.",
+    "Error caught: %c doesn't own the potion %s.",
+    "%c takes %d damage from poison.",
+    "%c regenerates %d HP.",
+    "Error caught: effect amounts and timings must be positive.",
+    "Error caught: turns to wait must be positive.",
+    "Error caught: %c doesn't own the spell %s.",
+};
+static_assert(size(storyTemplates) == size_t(Story::Count));
 
+struct StoryArg {
+    enum class Kind : uint8_t { Character, Text, Number };
+    Kind kind;
+    CharacterId id = noCharacter;
+    string_view text;  // the name of a character
+    int number = 0;
 
-class Spell : public PhysicalItem {
-    vector<Character*> allowedTargets;
+    StoryArg(const Character& character);
+    StoryArg(CharacterId id, string_view name) : kind(Kind::Character), id(id), text(name) {}
+    StoryArg(string_view text) : kind(Kind::Text), text(text) {}
+    StoryArg(const string& text) : kind(Kind::Text), text(text) {}
+    StoryArg(const char* text) : kind(Kind::Text), text(text) {}
+    StoryArg(int number) : kind(Kind::Number), number(number) {}
+};
+
+// Appends the text of a story line, without the newline.
+void formatStory(string& out, Story line, span<const StoryArg> args) {
+    string_view text = storyTemplates[size_t(line)];
+    const StoryArg* arg = args.data();
+    for (size_t pos; (pos = text.find('%')) != string_view::npos; ++arg) {
+        assert(arg < args.data() + args.size());
+        out.append(text.substr(0, pos));
+        if (arg->kind == StoryArg::Kind::Number) {
+            char digits[16];
+            out.append(digits, to_chars(digits, digits + sizeof(digits), arg->number).ptr - digits);
+        } else {
+            out.append(arg->text);
+        }
+        text.remove_prefix(pos + 2);
+    }
+    out.append(text);
+}
+
+// Binary story logs start with this and the version, followed by records: a Story
+// byte and its arguments, or one of the definition records below. Characters are
+// varint ids named by an earlier definition; strings are a varint holding either a
+// table index times two or their length times two plus one followed by the bytes;
+// numbers are zigzag varints.
+constexpr string_view storyMagic("STY\0", 4);
+constexpr uint8_t storyVersion = 1;
+constexpr uint8_t storyNameRecord = 0xFF;    // character id, length, name
+constexpr uint8_t storyStringRecord = 0xFE;  // length and bytes of the next table string
+
+class Narrator {
 public:
-    Spell(string name, Character* owner, vector<Character*> allowedTargets)
-        : PhysicalItem(name, owner, false), allowedTargets(std::move(allowedTargets)) {}
+    // Sync flushes the file after every line, Buffered leaves flushing to the stream
+    // and Async hands lines to a background writer thread.
+    enum class Mode { Sync, Buffered, Async };
 
-    void use(Character* user, Character* target) override {
-        if (!user || !user->isAlive()) {
-            narrator.logEvent("Error: User is not alive or does not exist.");
+    // Text lines, or compact binary records for --decode-log to render.
+    enum class Format { Text, Binary };
+
+    // When the background writer in async mode puts queued lines into the file. The
+    // queue is always drained when it fills up and when the narrator stops, so zero
+    // batch and interval means lines are written only on exit or under backpressure.
+    struct FlushPolicy {
+        size_t batchBytes = 64 * 1024;             // write once this much is queued, 0 = never
+        chrono::milliseconds interval{100};        // write lines at least this old, 0 = never
+        size_t queueBytes = 1 << 20;               // ring capacity, rounded up to a power of two
+    };
+
+private:
+    std::ofstream logFile;
+    string* capture = nullptr;  // lines collected in memory instead of the file
+    Mode mode = Mode::Sync;
+    Format format = Format::Text;
+    string record;  // the line or record being built
+    string repeated;  // copies of record for tell with a count
+    // Binary format: characters already named in the log, and the strings given table
+    // indexes so far. The table stops growing at maxStrings; later strings go inline.
+    vector<bool> named;
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(string_view text) const { return hash<string_view>{}(text); }
+    };
+    unordered_map<string, uint32_t, StringHash, equal_to<>> strings;
+    static constexpr size_t maxStrings = 1 << 16;
+    FlushPolicy policy;
+    chrono::nanoseconds busy{0};  // inside tell; metrics builds only
+    unique_ptr<SpscByteRing> queue;
+    thread writer;
+    mutex wakeMutex;
+    condition_variable wake;
+    condition_variable drained;
+    bool stopping = false;
+    atomic<bool> wakePending{false};
+    atomic<size_t> written{0};  // queued bytes the writer has put into the file
+
+    void emit(string_view bytes) {
+        if (capture) {
+            capture->append(bytes);
             return;
         }
-        if (!target || !target->isAlive()) {
-            narrator.logEvent("Error: Target is not valid or not alive.");
+        if (mode == Mode::Sync) {
+            logFile.write(bytes.data(), bytes.size());
+            logFile.flush();
             return;
         }
-        auto it = find(allowedTargets.begin(), allowedTargets.end(), target);
-        if (it == allowedTargets.end()) {
-            narrator.logEvent(user->getName() + " attempted to cast " + name + " on an unauthorized target: " + target->getName() + ".");
+        if (mode == Mode::Buffered) {
+            logFile.write(bytes.data(), bytes.size());
             return;
         }
-        narrator.logEvent(user->getName() + " casts " + name + " on " + target->getName() + ".");
+        enqueue(bytes);
+        if (policy.batchBytes && queue->size() >= policy.batchBytes) {
+            wakeWriter();
+        }
     }
 
-    void setup() override {
+    void putString(string_view text) {
+        // Workers capturing for a parallel commit cannot share the table.
+        if (!capture) {
+            auto it = strings.find(text);
+            if (it == strings.end() && strings.size() < maxStrings) {
+                string definition(1, char(storyStringRecord));
+                putVarint(definition, text.size());
+                definition.append(text);
+                emit(definition);
+                it = strings.emplace(string(text), uint32_t(strings.size())).first;
+            }
+            if (it != strings.end()) {
+                putVarint(record, uint64_t(it->second) << 1);
+                return;
+            }
+        }
+        putVarint(record, uint64_t(text.size()) << 1 | 1);
+        record.append(text);
     }
 
-    void print(ostream& os) const override {
-        os << "Spell: " << name << endl;
+    void enqueue(string_view bytes) {
+        while (!bytes.empty()) {
+            size_t queued = queue->push(bytes);
+            bytes.remove_prefix(queued);
+            if (!bytes.empty()) {
+                // Queue full: hand the CPU to the writer instead of spinning on it.
+                wakeWriter();
+                unique_lock<mutex> lock(wakeMutex);
+                drained.wait(lock, [&] { return queue->size() < queue->capacity(); });
+            }
+        }
     }
-};
-class Potion : public PhysicalItem {
-    int healValue;
 
-public:
-    Potion(string name, Character* owner, int healValue)
-        : PhysicalItem(name, owner, true) {
-        if (healValue <= 0) {
-            throw std::invalid_argument("Error caught: healValue must be positive.");
+    void wakeWriter() {
+        if (!wakePending.exchange(true, memory_order_acq_rel)) {
+            lock_guard<mutex> lock(wakeMutex);
+            wake.notify_one();
         }
-        this->healValue = healValue;
     }
 
-    void use(Character* user, Character* target) override {
-        if (user && user->isAlive() && target && target->isAlive() && isUsableOnce) {
-            target->heal(healValue);
-            narrator.logEvent(user->getName() + " uses " + name + " on " + target->getName() + ", healing " + std::to_string(healValue) + " HP.");
-            isUsableOnce = false;
+    void writerLoop() {
+        for (;;) {
+            bool done;
+            {
+                unique_lock<mutex> lock(wakeMutex);
+                auto ready = [&] { return stopping || wakePending.load(memory_order_acquire); };
+                if (policy.interval.count() > 0) {
+                    wake.wait_for(lock, policy.interval, ready);
+                } else {
+                    wake.wait(lock, ready);
+                }
+                done = stopping;
+            }
+            wakePending.store(false, memory_order_release);
+            if (size_t bytes = queue->drain([&](string_view chunk) { logFile.write(chunk.data(), chunk.size()); })) {
+                {
+                    lock_guard<mutex> lock(wakeMutex);
+                }
+                drained.notify_one();
+                logFile.flush();
+                written.fetch_add(bytes, memory_order_release);
+            }
+            if (done && queue->size() == 0) {
+                return;
+            }
         }
     }
 
-    void setup() override {
+public:
+    Narrator(const std::string& filename) : logFile(filename) {
+        if (!logFile.is_open()) {
+            throw std::runtime_error("Failed to open log file.");
+        }
     }
 
-    void print(ostream& os) const override {
-        os << "Potion: " << name << " HealValue: " << healValue << endl;
+    // Collects the lines in memory, each ending in a newline.
+    explicit Narrator(string& into) : capture(&into) {}
+
+    // Chooses the format before the first line is logged.
+    void setFormat(Format newFormat) {
+        format = newFormat;
+        if (format == Format::Binary && !capture) {
+            string header(storyMagic);
+            header.push_back(char(storyVersion));
+            emit(header);
+        }
     }
-};
 
+    Format getFormat() const { return format; }
+
+    // Switches between writing every line on the calling thread and queueing lines for
+    // a background writer. Meant for startup and shutdown: only one thread may log.
+    void setMode(Mode newMode) {
+        setMode(newMode, FlushPolicy());
+    }
 
+    void setMode(Mode newMode, FlushPolicy newPolicy) {
+        if (mode == Mode::Async) {
+            {
+                lock_guard<mutex> lock(wakeMutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+            queue.reset();
+            stopping = false;
+            written.store(0, memory_order_relaxed);
+        }
+        logFile.flush();
+        mode = newMode;
+        policy = newPolicy;
+        if (mode == Mode::Async) {
+            size_t capacity = 64;
+            while (capacity < policy.queueBytes) {
+                capacity <<= 1;
+            }
+            queue = make_unique<SpscByteRing>(capacity);
+            writer = thread(&Narrator::writerLoop, this);
+        }
+    }
 
+    Mode getMode() const { return mode; }
+    chrono::nanoseconds busyTime() const { return busy; }
 
+    // For a crashing process: lets the async writer catch up with every line queued so
+    // far. The writer wakes on its flush interval, so with a zero interval lines still
+    // in the queue are lost.
+    void flushFromSignal() {
+        if (mode == Mode::Async) {
+            size_t queued = queue->pushed();
+            spinUntil([&] { return written.load(memory_order_acquire) >= queued; });
+        }
+    }
 
+    // Characters are named in a binary log once, when first created, so that their
+    // records can refer to them by id.
+    void nameCharacter(CharacterId id, string_view name) {
+        if (format != Format::Binary || (id < named.size() && named[id])) {
+            return;
+        }
+        if (id >= named.size()) {
+            named.resize(id + 1);
+        }
+        named[id] = true;
+        record.assign(1, char(storyNameRecord));
+        putVarint(record, id);
+        putVarint(record, name.size());
+        record.append(name);
+        emit(record);
+    }
 
+    void tell(Story line, initializer_list<StoryArg> args) {
+        MetricsTimer timer(busy);
+        record.clear();
+        if (format == Format::Text) {
+            formatStory(record, line, args);
+            record.push_back('\n');
+            emit(record);
+            return;
+        }
+        record.push_back(char(line));
+        for (const StoryArg& arg : args) {
+            switch (arg.kind) {
+                case StoryArg::Kind::Character: putVarint(record, arg.id); break;
+                case StoryArg::Kind::Text: putString(arg.text); break;
+                case StoryArg::Kind::Number: putVarint(record, zigzag(arg.number)); break;
+            }
+        }
+        emit(record);
+    }
 
+    // Logs the same line times over, as that many calls would, but builds it only once.
+    // The first call defines any new strings, so the copies are all alike.
+    void tell(Story line, initializer_list<StoryArg> args, size_t times) {
+        if (times == 0) {
+            return;
+        }
+        tell(line, args);
+        if (--times == 0) {
+            return;
+        }
+        MetricsTimer timer(busy);
+        size_t perBlock = min(times, max<size_t>(1, 64 * 1024 / record.size()));
+        repeated.clear();
+        for (size_t i = 0; i < perBlock; ++i) {
+            repeated += record;
+        }
+        for (; times >= perBlock; times -= perBlock) {
+            emit(repeated);
+        }
+        if (times) {
+            emit(string_view(repeated).substr(0, times * record.size()));
+        }
+    }
 
+    // Adds lines or records another narrator of the same format captured.
+    void append(string_view captured) {
+        if (!captured.empty()) {
+            emit(captured);
+        }
+    }
 
-class PotionUser {
-public:
-    virtual void drinkPotion(const string& potionName, Character* target) = 0;
-    virtual void showPotions() const = 0;
-    virtual ~PotionUser() {}
+    ~Narrator() {
+        setMode(Mode::Sync);
+        if (logFile.is_open()) {
+            logFile.close();
+        }
+    }
 };
 
 
+// Buffered writer for everything the simulation prints to stdout. Bytes collect in
+// one reusable buffer and reach the descriptor only when it fills, on flush(), or at
+// each newline when line flushing is on (interactive terminals).
+class OutputSink {
+    int fd;
+    bool ownsFd = false;
+    string* capture = nullptr;  // memory target instead of fd
+    unique_ptr<char[]> buffer;
+    size_t capacity;
+    size_t used = 0;
+    bool lineFlush = false;
+    bool stopped = false;
+    chrono::nanoseconds busy{0};  // inside write(2); metrics builds only
 
-class Weapon : public PhysicalItem{
-    int damage;
+    // Background writer of the pipelined mode. Full buffers travel to it in order and
+    // come back empty, so the simulation never waits for write(2) unless every spare
+    // buffer is still queued.
+    struct Writer {
+        SpscQueue<pair<char*, size_t>> full{8};
+        SpscQueue<char*> empty{8};
+        size_t spares = 0;
+        size_t submitted = 0;  // buffers handed over; touched by the simulation only
+        atomic<size_t> written{0};
+        atomic<int64_t> busyNs{0};
+        thread worker;
+    };
+    unique_ptr<Writer> writer;
 
-public:
-    Weapon(string name, Character* owner, int damage)
-        : PhysicalItem(name, owner, false) {
-        if (damage <= 0) {
-            throw std::invalid_argument("Error caught: damageValue must be positive.");
+    void writeAll(const char* data, size_t size) {
+        MetricsTimer timer(busy);
+        writeUntimed(data, size);
+    }
+
+    void writeUntimed(const char* data, size_t size) {
+        if (capture) {
+            capture->append(data, size);
+            return;
+        }
+        while (size && !stopped) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;  // nowhere left to report it; drop the output like a closed cout
+            }
+            data += written;
+            size -= written;
         }
-        this->damage = damage;
     }
 
-    void use(Character* user, Character* target) override {
-        if (user && target) {
-            target->takeDamage(damage);
-            narrator.logEvent(user->getName() + " attacks " + target->getName() + " with " + name + ", dealing " + std::to_string(damage) + " damage.");
+public:
+    explicit OutputSink(int fd, size_t capacity = 256 * 1024)
+        : fd(fd), buffer(new char[capacity]), capacity(capacity) {}
+
+    // Creates or truncates the file at path and closes it again on destruction.
+    explicit OutputSink(const string& path, size_t capacity = 256 * 1024)
+        : OutputSink(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), capacity) {
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open output file.");
         }
+        ownsFd = true;
     }
 
-    void setup() override {}
+    // Collects the output in memory, appended to into on every flush.
+    explicit OutputSink(string& into, size_t capacity)
+        : fd(-1), capture(&into), buffer(new char[capacity]), capacity(capacity) {}
 
-    void print(ostream& os) const override {
-        os << "Weapon: " << name << " Damage: " << damage << endl;
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    void setLineFlush(bool enabled) { lineFlush = enabled; }
+    chrono::nanoseconds busyTime() const {
+        return busy + chrono::nanoseconds(writer ? writer->busyNs.load(memory_order_relaxed) : 0);
     }
-};
 
-class WeaponUser {
-public:
-    virtual void attack(Character* target, const string& weaponName) = 0;
-    virtual void showWeapons() = 0;
-    virtual ~WeaponUser() {}
-};
+    // Moves write(2) onto a background thread with the given number of spare buffers.
+    void startWriter(size_t spares = 3) {
+        writer = make_unique<Writer>();
+        writer->spares = spares;
+        for (size_t i = 0; i < spares; ++i) {
+            writer->empty.push(new char[capacity]);
+        }
+        writer->worker = thread([this] {
+            for (auto [data, size] = writer->full.pop(); data; tie(data, size) = writer->full.pop()) {
+                chrono::nanoseconds spent{0};
+                {
+                    MetricsTimer timer(spent);
+                    writeUntimed(data, size);
+                }
+                writer->busyNs.fetch_add(spent.count(), memory_order_relaxed);
+                writer->empty.push(data);
+                writer->written.fetch_add(1, memory_order_release);
+                writer->written.notify_one();
+            }
+        });
+    }
 
-class Fighter : public Character, public WeaponUser, public PotionUser {
-protected:
-    Container<Weapon> arsenal;
-    Container<Potion> medicalBag;
-public:
+    void stopWriter() {
+        if (!writer) {
+            return;
+        }
+        flush();
+        writer->full.push({nullptr, 0});
+        writer->worker.join();
+        for (size_t i = 0; i < writer->spares; ++i) {
+            delete[] writer->empty.pop();
+        }
+        busy += chrono::nanoseconds(writer->busyNs.load(memory_order_relaxed));
+        writer.reset();
+    }
 
-    Fighter(string name, int hp) : Character(name, hp), arsenal(3), medicalBag(5) {}
-    bool canCarryWeapon() const override { return true; }
-    bool canCarryPotion() const override { return true; }
-    bool canCarrySpell() const override { return false; }
-    std::string getType() const override {
-        return "Fighter";}
-    bool addItem(std::unique_ptr<PhysicalItem> item) override {
-        if (typeid(*item) == typeid(Weapon) && !canCarryWeapon()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry weapons.");
-            return false;
-        } else if (typeid(*item) == typeid(Potion) && !canCarryPotion()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry potions.");
-            return false;
-        } else if (typeid(*item) == typeid(Spell) && !canCarrySpell()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry spells.");
-            return false;
+    // Blocks until the background writer has written every buffer handed to it.
+    void waitForWriter() {
+        if (writer) {
+            for (size_t done; (done = writer->written.load(memory_order_acquire)) != writer->submitted;) {
+                writer->written.wait(done, memory_order_acquire);
+            }
         }
+    }
 
-        if (auto weaponPtr = dynamic_cast<Weapon*>(item.get())) {
-            std::unique_ptr<Weapon> weaponUniquePtr(weaponPtr);
-            item.release();
-            return arsenal.addItem(std::move(weaponUniquePtr));
-        } else if (auto potionPtr = dynamic_cast<Potion*>(item.get())) {
-            std::unique_ptr<Potion> potionUniquePtr(potionPtr);
-            item.release();
-            return medicalBag.addItem(std::move(potionUniquePtr));
+    void flush() {
+        if (!writer) {
+            writeAll(buffer.get(), used);
+        } else if (used) {
+            ++writer->submitted;
+            writer->full.push({buffer.release(), used});
+            buffer.reset(writer->empty.pop());
         }
+        used = 0;
+    }
 
-        narrator.logEvent("Error caught: Item type not supported for " + getName() + ".");
-        return false;
+    // For a crashing process: writes out the queued buffers and then the current one
+    // without taking any locks.
+    void flushFromSignal() {
+        if (writer) {
+            spinUntil([&] { return writer->written.load(memory_order_acquire) == writer->submitted; });
+            if (buffer) {
+                writeAll(buffer.get(), used);
+            }
+            used = 0;
+        } else {
+            flush();
+        }
     }
-    void showPotions() const override{
-        medicalBag.print();
+
+    // Flushes what was written so far and discards everything written afterwards.
+    void stop() {
+        flush();
+        waitForWriter();
+        stopped = true;
     }
-    void attack(Character* target, const string& weaponName) override {
-        if (!this->isAlive()) {
-            throw std::runtime_error(getName() + " is not alive to perform an attack.");
+
+    OutputSink& operator<<(string_view text) {
+        if (text.size() > capacity - used) {
+            flush();
+            if (text.size() >= capacity) {
+                waitForWriter();
+                writeAll(text.data(), text.size());
+                return *this;
+            }
         }
-        if (!target || !target->isAlive()) {
-            throw std::runtime_error("Target is not valid or not alive.");
+        // Missing tokens are default string_views, whose data() may be null.
+        if (!text.empty()) {
+            memcpy(buffer.get() + used, text.data(), text.size());
         }
-        Weapon* weapon = arsenal.getItem(weaponName);
-        if (!weapon) {
-            throw std::runtime_error("Weapon " + weaponName + " not found in arsenal.");
+        used += text.size();
+        if (lineFlush && text.ends_with('\n')) {
+            flush();
         }
-        weapon->use(this, target);
+        return *this;
     }
 
-    void showWeapons() override {
-        arsenal.print();
+    OutputSink& repeat(string_view text, size_t times) {
+        for (size_t i = 0; i < times; ++i) {
+            *this << text;
+        }
+        return *this;
     }
-    void drinkPotion(const string& potionName, Character* target) override {
-        if (!this->isAlive()) {
-            throw std::runtime_error(getName() + " is not alive to drink a potion.");
+
+    OutputSink& operator<<(const char* text) { return *this << string_view(text); }
+    OutputSink& operator<<(const string& text) { return *this << string_view(text); }
+
+    OutputSink& operator<<(char c) {
+        if (used == capacity) {
+            flush();
         }
-        Potion* potion = medicalBag.getItem(potionName);
-        if (!potion) {
-            throw std::runtime_error("Potion " + potionName + " not found in medical bag.");
+        buffer[used++] = c;
+        if (c == '\n' && lineFlush) {
+            flush();
         }
-        potion->use(this, target);
-        medicalBag.removeItem(potionName); // Ensure the potion is removed after use.
+        return *this;
     }
-    void print(ostream& os) const override {
-        Character::print(os); // Use Character's print and then add additional details if needed
+
+    OutputSink& operator<<(int value) {
+        constexpr size_t maxDigits = numeric_limits<int>::digits10 + 2;  // sign and rounding
+        if (capacity - used < maxDigits) {
+            flush();
+        }
+        used = to_chars(buffer.get() + used, buffer.get() + capacity, value).ptr - buffer.get();
+        return *this;
     }
-};
 
+    OutputSink& operator<<(uint64_t value) {
+        constexpr size_t maxDigits = numeric_limits<uint64_t>::digits10 + 1;
+        if (capacity - used < maxDigits) {
+            flush();
+        }
+        used = to_chars(buffer.get() + used, buffer.get() + capacity, value).ptr - buffer.get();
+        return *this;
+    }
+
+    ~OutputSink() {
+        stopWriter();
+        flush();
+        if (ownsFd) {
+            ::close(fd);
+        }
+    }
+};
 
 
 
+struct PoolStats {
+    size_t live = 0;       // objects currently allocated
+    size_t highWater = 0;  // most objects ever allocated at once
+    size_t slots = 0;      // capacity of all slabs
+};
 
-class SpellUser {
+class PoolBase {
 public:
-    virtual void castSpell(const string& spellName, Character* target) = 0;
-    virtual void showSpells() const = 0;
-    virtual ~SpellUser() {}
+    virtual void deallocate(void* storage) = 0;
+    virtual ~PoolBase() {}
+
+    // Taken around every allocation and release while events run on several threads;
+    // null otherwise.
+    mutex* guard = nullptr;
 };
 
-class Wizard : public Character, public SpellUser, public PotionUser{
-    Container<Spell> spellBook;
-    Container<Potion> medicalBag;
-
-public:
-    Wizard(string name, int hp) : Character(name, hp), spellBook(10), medicalBag(10) {}
-
-    bool canCarryWeapon() const override { return false; }
-    bool canCarryPotion() const override { return true; }
-    bool canCarrySpell() const override { return true; }
+// Hands out storage for objects of one type from slabs of fixed-size slots. Freed
+// slots go on an intrusive free list; fresh slots are bumped off the slabs in order,
+// which lets reset() recycle every slab at once without touching the slots.
+template<typename T>
+class ObjectPool : public PoolBase {
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    struct Slab {
+        unique_ptr<Slot[]> slots;
+        size_t size;
+    };
+    static constexpr size_t firstSlabSize = 64;
+    static constexpr size_t maxSlabSize = 4096;
 
-    bool addItem(std::unique_ptr<PhysicalItem> item) override {
-        // First, check if the character can carry the item based on its type.
-        if (typeid(*item) == typeid(Weapon) && !canCarryWeapon()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry weapons.");
-            return false;
-        } else if (typeid(*item) == typeid(Potion) && !canCarryPotion()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry potions.");
-            return false;
-        } else if (typeid(*item) == typeid(Spell) && !canCarrySpell()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry spells.");
-            return false;
-        }
+    vector<Slab> slabs;
+    size_t bumpSlab = 0;   // slab fresh slots come from
+    size_t bumpIndex = 0;  // next fresh slot in that slab
+    Slot* freeList = nullptr;
+    PoolStats counters;
 
-        // Attempt to add the item to the appropriate container.
-        if (typeid(*item) == typeid(Spell)) {
-            // Release the ownership of the base pointer and cast it to the derived type.
-            Spell* spellPtr = static_cast<Spell*>(item.release());
-            // Take ownership with the correct unique_ptr type.
-            std::unique_ptr<Spell> spellUniquePtr(spellPtr);
-            // Add the item to the spellBook container.
-            return spellBook.addItem(std::move(spellUniquePtr));
+public:
+    void* allocate() {
+        unique_lock<mutex> lock = guard ? unique_lock<mutex>(*guard) : unique_lock<mutex>();
+        Slot* slot = freeList;
+        if (slot) {
+            freeList = slot->next;
+        } else {
+            if (bumpSlab < slabs.size() && bumpIndex == slabs[bumpSlab].size) {
+                ++bumpSlab;
+                bumpIndex = 0;
+            }
+            if (bumpSlab == slabs.size()) {
+                size_t size = slabs.empty() ? firstSlabSize : min(slabs.back().size * 2, maxSlabSize);
+                slabs.push_back({make_unique<Slot[]>(size), size});
+                counters.slots += size;
+            }
+            slot = &slabs[bumpSlab].slots[bumpIndex++];
         }
+        counters.highWater = max(counters.highWater, ++counters.live);
+        return slot->storage;
+    }
 
-        return false;
+    void deallocate(void* storage) override {
+        unique_lock<mutex> lock = guard ? unique_lock<mutex>(*guard) : unique_lock<mutex>();
+        Slot* slot = static_cast<Slot*>(storage);
+        slot->next = freeList;
+        freeList = slot;
+        --counters.live;
     }
-    std::string getType() const override {
-        return "Wizard";}
 
+    // Forgets every allocation and the high-water mark but keeps the slabs for reuse.
+    // Every object from the pool must already be destroyed.
+    void reset() {
+        assert(counters.live == 0);
+        freeList = nullptr;
+        bumpSlab = 0;
+        bumpIndex = 0;
+        counters.highWater = 0;
+    }
 
+    PoolStats stats() const { return counters; }
+};
 
-//    bool addItem(std::unique_ptr<PhysicalItem> item) override {
-//        if (typeid(*item) == typeid(Weapon)) {
-//            narrator.logEvent("Error caught: Wizard " + getName() + " can't have weapons.");
-//            return false;
-//        } else if (typeid(*item) == typeid(Potion)) {
-//            auto potionPtr = static_cast<Potion*>(item.release());
-//            std::unique_ptr<Potion> potionUniquePtr(potionPtr);
-//            return medicalBag.addItem(std::move(potionUniquePtr));
-//        } else if (typeid(*item) == typeid(Spell)) {
-//            auto spellPtr = static_cast<Spell*>(item.release());
-//            std::unique_ptr<Spell> spellUniquePtr(spellPtr);
-//            return spellBook.addItem(std::move(spellUniquePtr));
-//        }
-//        narrator.logEvent("Error caught: Item type not supported for " + getName() + ".");
-//        return false;
-//    }
+// Destroys an object and returns its storage to the pool it came from. Objects that
+// did not come from a pool are deleted normally.
+struct PoolDeleter {
+    PoolBase* pool = nullptr;
 
-    void castSpell(const string& spellName, Character* target) override {
-        Spell* spell = spellBook.getItem(spellName);
-        if (spell) {
-            spell->use(this, target);
-            // Assuming the spell is used up and removed from the spell book
-            spellBook.removeItem(spellName);
+    template<typename T>
+    void operator()(T* object) const {
+        if (!pool) {
+            delete object;
+            return;
         }
+        void* storage = dynamic_cast<void*>(object);
+        object->~T();
+        pool->deallocate(storage);
     }
+};
 
-    void showSpells() const override {
-        spellBook.print();
-    }
+template<typename T>
+using PoolPtr = unique_ptr<T, PoolDeleter>;
 
-    void drinkPotion(const string& potionName, Character* target) override {
-        if (!this->isAlive()) {
-            throw std::runtime_error(getName() + " is not alive to drink a potion.");
+enum class ItemKind : uint8_t { Weapon, Potion, Spell };
+
+// Bit of a kind in a character class's carryMask.
+constexpr unsigned carries(ItemKind kind) {
+    return 1u << static_cast<unsigned>(kind);
+}
+
+// How an attack, a drink or a cast went. Anything but Done means the action did
+// nothing; the event logs why (see reportFailure) and goes on with the next one.
+enum class ActionResult : uint8_t {
+    Done,
+    AttackerNotAlive,
+    TargetNotValid,
+    MissingWeapon,
+    DrinkerNotAlive,
+    MissingPotion,
+    MissingSpell,
+};
+
+class PhysicalItem {
+protected:
+    CharacterHandle owner;
+    string name;
+    const ItemKind kind;
+
+public:
+    PhysicalItem(ItemKind kind, string name, CharacterHandle owner, bool isUsableOnce)
+        : owner(owner), name(name), kind(kind), isUsableOnce(isUsableOnce) {}
+
+    virtual ~PhysicalItem() {}
+    bool isUsableOnce;
+    // Fails with the Missing result of the item's kind when the user is not the
+    // incarnation it was made for.
+    [[nodiscard]] virtual ActionResult use(Character* user, Character* target) = 0;
+    const string& getName() const { return name; }
+    ItemKind getKind() const { return kind; }
+    CharacterHandle getOwner() const { return owner; }
+    // Whether the character is the incarnation this item was made for.
+    bool ownedBy(const Character& character) const;
+    virtual void setup() = 0;
+protected:
+    virtual void print(OutputSink& os) const = 0;
+};
+
+
+
+enum class CharacterKind : uint8_t { Fighter, Wizard, Archer };
+constexpr uint8_t anyCharacterKind = 0xFF;  // selects every kind in area effects
+
+// Adds delta to the HP of every living character of the selected kind with an id in
+// [begin, end). HP that drops to zero or below is clamped to zero, the alive flag is
+// cleared and the id appended to deaths, so deaths come out in increasing id order.
+using AreaKernelFn = void (*)(int32_t* hp, uint8_t* alive, const uint8_t* kind, size_t begin, size_t end,
+                              uint8_t selected, int32_t delta, vector<CharacterId>& deaths);
+
+void applyAreaScalar(int32_t* hp, uint8_t* alive, const uint8_t* kind, size_t begin, size_t end,
+                     uint8_t selected, int32_t delta, vector<CharacterId>& deaths) {
+    for (size_t i = begin; i < end; ++i) {
+        if (!alive[i] || (selected != anyCharacterKind && kind[i] != selected)) {
+            continue;
         }
-        Potion* potion = medicalBag.getItem(potionName);
-        if (!potion) {
-            throw std::runtime_error("Potion " + potionName + " not found in medical bag.");
+        int32_t next = int32_t(uint32_t(hp[i]) + uint32_t(delta));
+        if (next <= 0) {
+            hp[i] = 0;
+            alive[i] = 0;
+            deaths.push_back(CharacterId(i));
+        } else {
+            hp[i] = next;
         }
-        potion->use(this, target);
-        medicalBag.removeItem(potionName); // Ensure the potion is removed after use.
     }
+}
 
-    void showPotions() const override{
-        medicalBag.print();
+#if defined(__x86_64__) || defined(__i386__)
+// Eight characters per step: selection and death masks come from compares, HP is
+// updated with a blend, and only the lanes that died are handled one by one.
+__attribute__((target("avx2")))
+void applyAreaAvx2(int32_t* hp, uint8_t* alive, const uint8_t* kind, size_t begin, size_t end,
+                   uint8_t selected, int32_t delta, vector<CharacterId>& deaths) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i add = _mm256_set1_epi32(delta);
+    const __m256i wanted = _mm256_set1_epi32(selected);
+    const __m256i everyKind = selected == anyCharacterKind ? _mm256_set1_epi32(-1) : zero;
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hp + i));
+        __m256i kinds = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(kind + i)));
+        __m256i living = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(alive + i)));
+        __m256i hit = _mm256_andnot_si256(_mm256_cmpeq_epi32(living, zero),
+                                          _mm256_or_si256(_mm256_cmpeq_epi32(kinds, wanted), everyKind));
+        __m256i next = _mm256_add_epi32(lanes, add);
+        __m256i died = _mm256_and_si256(hit, _mm256_cmpgt_epi32(one, next));
+        next = _mm256_max_epi32(next, zero);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(hp + i), _mm256_blendv_epi8(lanes, next, hit));
+        for (unsigned mask = unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(died))); mask; mask &= mask - 1) {
+            size_t id = i + countr_zero(mask);
+            alive[id] = 0;
+            deaths.push_back(CharacterId(id));
+        }
     }
+    applyAreaScalar(hp, alive, kind, i, end, selected, delta, deaths);
+}
+#endif
 
-    // Additional methods as needed
+struct AreaKernel {
+    const char* name;
+    AreaKernelFn apply;
 };
 
+AreaKernel pickAreaKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", applyAreaAvx2};
+    }
+#endif
+    return {"scalar", applyAreaScalar};
+}
 
+const AreaKernel areaKernel = pickAreaKernel();
 
-class Archer : public Character, public WeaponUser, public SpellUser,  public PotionUser {
-protected:
-    Container<Weapon> arsenal;
-    Container<Potion> medicalBag;
-    Container<Spell> spellBook;
+// HP, alive flag, kind and generation of every character, one array per field
+// indexed by CharacterId. Characters read and write their vitals here, and area
+// effects sweep the arrays directly instead of visiting each character object.
+class VitalsStore {
+    vector<int32_t> hp;
+    vector<uint8_t> alive;
+    vector<uint8_t> kind;
+    vector<uint32_t> generation;
 
 public:
-    Archer(string name, int hp) : Character(name, hp), arsenal(2), medicalBag(3), spellBook(2) {}
-    bool addItem(std::unique_ptr<PhysicalItem> item) override {
-        if (typeid(*item) == typeid(Weapon) && !canCarryWeapon()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry weapons.");
-            return false;
-        } else if (typeid(*item) == typeid(Potion) && !canCarryPotion()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry potions.");
+    void assign(CharacterId id, CharacterKind characterKind, int value) {
+        if (id >= hp.size()) {
+            hp.resize(id + 1);
+            alive.resize(id + 1);
+            kind.resize(id + 1);
+            generation.resize(id + 1);
+        }
+        hp[id] = value;
+        alive[id] = value > 0;
+        kind[id] = uint8_t(characterKind);
+    }
+
+    // Called when an event creates a character, not when a retired one is rebuilt.
+    void startGeneration(CharacterId id) { ++generation[id]; }
+
+    int getHP(CharacterId id) const { return hp[id]; }
+    CharacterKind getKind(CharacterId id) const { return CharacterKind(kind[id]); }
+    bool isAlive(CharacterId id) const { return alive[id]; }
+    CharacterHandle handleOf(CharacterId id) const { return {id, generation[id]}; }
+    bool isCurrent(CharacterHandle handle) const {
+        return handle.id < generation.size() && generation[handle.id] == handle.generation;
+    }
+
+    void heal(CharacterId id, int amount) {
+        hp[id] = int32_t(uint32_t(hp[id]) + uint32_t(amount));
+        alive[id] = hp[id] > 0;
+    }
+
+    // Returns true when this blow killed the character. Touches only this character's
+    // entries, so blows to different characters may land from different threads.
+    bool damage(CharacterId id, int amount) {
+        if (!alive[id]) {
             return false;
-        } else if (typeid(*item) == typeid(Spell) && !canCarrySpell()) {
-            narrator.logEvent("Error caught: " + getName() + " can't carry spells.");
+        }
+        int32_t next = int32_t(uint32_t(hp[id]) - uint32_t(amount));
+        if (next > 0) {
+            hp[id] = next;
             return false;
         }
+        hp[id] = 0;
+        alive[id] = 0;
+        return true;
+    }
+
+    // Applies delta to every living character of the selected kind and returns the
+    // ids that died, in increasing order.
+    const vector<CharacterId>& applyArea(uint8_t selected, int delta) {
+        deaths.clear();
+        areaKernel.apply(hp.data(), alive.data(), kind.data(), 0, hp.size(), selected, delta, deaths);
+        return deaths;
+    }
 
-        if (auto weaponPtr = dynamic_cast<Weapon*>(item.get())) {
-            std::unique_ptr<Weapon> weaponUniquePtr(weaponPtr);
-            item.release(); // Prevent double deletion
-            return arsenal.addItem(std::move(weaponUniquePtr));
-        } else if (auto potionPtr = dynamic_cast<Potion*>(item.get())) {
-            std::unique_ptr<Potion> potionUniquePtr(potionPtr);
-            item.release(); // Prevent double deletion
-            return medicalBag.addItem(std::move(potionUniquePtr));
-        } else if (auto spellPtr = dynamic_cast<Spell*>(item.get())) {
-            std::unique_ptr<Spell> spellUniquePtr(spellPtr);
-            item.release(); // Prevent double deletion
-            return spellBook.addItem(std::move(spellUniquePtr));
+    // Same for an explicit list of ids, applied in list order; a repeated id is hit
+    // once per mention. The deaths still come back in increasing id order.
+    const vector<CharacterId>& applyList(const vector<CharacterId>& ids, int delta) {
+        deaths.clear();
+        for (CharacterId id : ids) {
+            applyAreaScalar(hp.data(), alive.data(), kind.data(), id, id + 1, anyCharacterKind, delta, deaths);
         }
+        sort(deaths.begin(), deaths.end());
+        return deaths;
+    }
+
+private:
+    vector<CharacterId> deaths;
+};
+
+// Abstract Character class
+class Character {
+    friend class PhysicalItem;
+protected:
+    string name;
+    CharacterId id;
+public:
+    Character(CharacterKind kind, CharacterId id, string name, int hp) : name(name), id(id) {
+        vitals().assign(id, kind, hp);
+        narrator().nameCharacter(id, this->name);
+    }
+    virtual ~Character() {}
+
+    bool isAlive() const {
+        return vitals().isAlive(id);
+    }
+    virtual string_view getTypeName() const = 0;
+    std::string getType() const { return string(getTypeName()); }
+    virtual bool addItem(PoolPtr<PhysicalItem> item) = 0;
+    // Appends every carried item, container by container, each in name order.
+    virtual void collectItems(vector<const PhysicalItem*>& items) const = 0;
+
+    const string& getName() const { return name; }
+    CharacterId getId() const { return id; }
+    CharacterHandle getHandle() const { return vitals().handleOf(id); }
+    int getHP() const { return vitals().getHP(id); }
+
+    void heal(int healValue) {
+        vitals().heal(id, healValue);
+        healthChanged(*this);
+    }
+
+    virtual void print(OutputSink& os) const {
+        os << "Character: " << name << " HP: " << getHP() << '\n';
+    }
+protected:
+    // Hands an item whose kind was already checked to the container for its type.
+    template<typename T>
+    static PoolPtr<T> itemCast(PoolPtr<PhysicalItem> item) {
+        PoolDeleter deleter = item.get_deleter();
+        return PoolPtr<T>(static_cast<T*>(item.release()), deleter);
+    }
 
-        narrator.logEvent("Error caught: Item type not supported for " + getName() + ".");
+    bool refuseItem(ItemKind kind) {
+        static constexpr const char* plural[] = {"weapons", "potions", "spells"};
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::CannotCarry, {*this, plural[static_cast<int>(kind)]});
         return false;
     }
-//    bool addItem(std::unique_ptr<PhysicalItem> item) override {
-//        if (typeid(*item) == typeid(Weapon)) {
-//            auto weaponPtr = static_cast<Weapon*>(item.release()); // Release ownership and cast
-//            std::unique_ptr<Weapon> weaponUniquePtr(weaponPtr); // Take ownership as the correct type
-//            return arsenal.addItem(std::move(weaponUniquePtr));
-//        } else if (typeid(*item) == typeid(Potion)) {
-//            auto potionPtr = static_cast<Potion*>(item.release()); // Release and cast
-//            std::unique_ptr<Potion> potionUniquePtr(potionPtr); // Take ownership as the correct type
-//            return medicalBag.addItem(std::move(potionUniquePtr));
-//        } else if (typeid(*item) == typeid(Spell)) {
-//            auto spellPtr = static_cast<Spell*>(item.release()); // Release and cast
-//            std::unique_ptr<Spell> spellUniquePtr(spellPtr); // Take ownership as the correct type
-//            return spellBook.addItem(std::move(spellUniquePtr));
-//        }
-//        narrator.logEvent("Error caught: Item type not supported for Archer " + getName() + ".");
-//        return false;
-//    }
-    std::string getType() const override {
-        return "Archer";}
-    void attack(Character* target, const string& weaponName) override {
-        if (!target || !target->isAlive()) {
-            narrator.logEvent("Error caught: " + getName() + " is not alive to perform an attack.");
+public:
+    void takeDamage(int damage) {
+        if (!isAlive()) {
             return;
         }
-        Weapon* weapon = arsenal.getItem(weaponName);
-        if (!weapon) {
-            narrator.logEvent("Error caught: " + getName() + " doesn't own the weapon " + weaponName + ".");
-            return;
+        if (vitals().damage(id, damage)) {
+            narrator().tell(Story::Died, {*this});
+            characterDied(*this);
         }
-        weapon->use(this, target);
+        healthChanged(*this);
     }
+};
+StoryArg::StoryArg(const Character& character) : StoryArg(character.getId(), character.getName()) {}
 
-    void showWeapons() override {
-        arsenal.print();
+bool PhysicalItem::ownedBy(const Character& character) const {
+    return owner.id == character.getId() && vitals().isCurrent(owner);
+}
+
+template<typename T>
+concept DerivedFromPhysicalItem = is_base_of<PhysicalItem, T>::value;
+
+template<typename T>
+class Container{
+private:
+    map<string, unique_ptr<T>> elements;
+    int maxCapacity;
+public:
+
+};
+
+
+template<DerivedFromPhysicalItem T>
+class Container<T>{
+protected:
+    vector<T> elems;
+public:
+    Container(){
+        console() << "Base container created\n";
+    }
+    ~Container(){
+        console() << "Base container destroyedwha\n";
     }
+private:
+    // Sorted by name. Capacities are tiny (2-10 items), so a contiguous array that is
+    // reserved up front beats a tree: no per-node allocation and lookups stay in cache.
+    vector<PoolPtr<T>> elements;
+    size_t maxCapacity;
 
-    void castSpell(const string& spellName, Character* target) override {
-        if (this->isAlive()) {
-            Spell* spell = spellBook.getItem(spellName);
-            if (spell) {
-                spell->use(this, target);
-                spellBook.removeItem(spellName); // Remove the spell after use
-            }
-        }
+    typename vector<PoolPtr<T>>::iterator lowerBound(string_view itemName) {
+        return lower_bound(elements.begin(), elements.end(), itemName,
+                           [](const PoolPtr<T>& item, string_view name) { return string_view(item->getName()) < name; });
+    }
+public:
+    Container(int size) : maxCapacity(size_t(max(size, 0))) {
+        elements.reserve(maxCapacity);
     }
 
-    void showSpells() const override {
-        spellBook.print();
+    bool addItem(PoolPtr<T> newItem) {
+        if (elements.size() >= maxCapacity) {
+            noteOutcome(EventOutcome::ContainerFull);
+            narrator().tell(Story::ContainerFull, {newItem->getName()});
+            return false;
+        }
+        auto it = lowerBound(newItem->getName());
+        // An item with the same name is kept and the new one is dropped.
+        if (it == elements.end() || (*it)->getName() != newItem->getName()) {
+            elements.insert(it, std::move(newItem));
+        }
+        return true;
     }
 
-    void drinkPotion(const string& potionName, Character* target) override {
-        if (!this->isAlive()) {
-            throw std::runtime_error(getName() + " is not alive to drink a potion.");
+
+    T* getItem(string_view itemName) {
+        auto it = lowerBound(itemName);
+        if (it != elements.end() && (*it)->getName() == itemName) {
+            return it->get();
         }
-        Potion* potion = medicalBag.getItem(potionName);
-        if (!potion) {
-            throw std::runtime_error("Potion " + potionName + " not found in medical bag.");
+        return nullptr;
+    }
+
+    bool removeItem(string_view itemName) {
+        auto it = lowerBound(itemName);
+        if (it == elements.end() || (*it)->getName() != itemName) {
+            return false;
         }
-        potion->use(this, target);
-        medicalBag.removeItem(potionName); // Ensure the potion is removed after use.
+        elements.erase(it);
+        return true;
     }
 
-    void showPotions() const override {
-        medicalBag.print();
+    void print() const {
+        for (const auto& item : elements) {
+            item->print(console());
+        }
     }
 
+    void collect(vector<const PhysicalItem*>& items) const {
+        for (const auto& item : elements) {
+            items.push_back(item.get());
+        }
+    }
 };
 
 
 
 
+// The characters a long spell target list allows, fixed when the spell is created.
+// Dense sets are a bitset indexed by id and checked in constant time; sparse ones are a
+// sorted array searched by bisection, O(log m) in the m members. Spells created with
+// the same list share one set; see TargetSetTable.
+class TargetSet {
+    vector<uint64_t> bits;       // dense form, bit id set for every member
+    vector<CharacterId> sorted;  // sparse form
+    size_t count;
 
-//сделать массив имен и обращаться к объекту по имени перса 2) сделать проверку в weapon user
+public:
+    // ids is the sorted, duplicate-free member list.
+    explicit TargetSet(vector<CharacterId> ids) : count(ids.size()) {
+        size_t words = ids.empty() ? 0 : ids.back() / 64 + 1;
+        if (words * sizeof(uint64_t) > 4 * ids.size() * sizeof(CharacterId)) {
+            sorted = std::move(ids);
+            return;
+        }
+        bits.resize(words);
+        for (CharacterId id : ids) {
+            bits[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
 
+    bool contains(CharacterId id) const {
+        if (!sorted.empty()) {
+            return binary_search(sorted.begin(), sorted.end(), id);
+        }
+        return id / 64 < bits.size() && (bits[id / 64] >> (id % 64) & 1);
+    }
 
-unordered_map<string, unique_ptr<Character>> characters;
-void processEvent(const string& event) {
-    istringstream iss(event);
-    string eventType;
-    iss >> eventType;
-
-    if (eventType == "Create") {
-        string itemType;
-        iss >> itemType;
-        if (itemType == "character") {
-            string type, name;
-            int initHP;
-            iss >> type >> name >> initHP;
-            if (type == "fighter") {
-                characters[name] = make_unique<Fighter>(name, initHP);
-            } else if (type == "wizard") {
-                characters[name] = make_unique<Wizard>(name, initHP);
-            } else if (type == "archer") {
-                characters[name] = make_unique<Archer>(name, initHP);
-            }
-            cout << "A new " << type << " came to town, " << name << "." << endl;
-        } else if (itemType == "item") {
-            string itemName, ownerName, itemNameSpecific;
-            iss >> itemName;
-            if (itemName == "weapon") {
-                int damageValue;
-                iss >> ownerName >> itemNameSpecific >> damageValue;
-                if (characters.find(ownerName) != characters.end()) {
-                    characters[ownerName]->addItem(make_unique<Weapon>(itemNameSpecific, characters[ownerName].get(), damageValue));
-                    cout << ownerName << " just obtained a new weapon called " << itemNameSpecific << "." << endl;
-                }
-            } else if (itemName == "potion") {
-                int healValue;
-                iss >> ownerName >> itemNameSpecific >> healValue;
-                if (characters.find(ownerName) != characters.end()) {
-                    characters[ownerName]->addItem(make_unique<Potion>(itemNameSpecific, characters[ownerName].get(), healValue));
-                    cout << ownerName << " just obtained a new potion called " << itemNameSpecific << "." << endl;
-                }
-            } else if (itemName == "spell") {
-                int m;
-                iss >> ownerName >> itemNameSpecific >> m;
-                vector<Character*> allowedTargets;
-                for (int i = 0; i < m; ++i) {
-                    string targetName;
-                    iss >> targetName;
-                    if (characters.find(targetName) != characters.end()) {
-                        allowedTargets.push_back(characters[targetName].get());
-                    }
-                }
-                if (characters.find(ownerName) != characters.end()) {
-                    characters[ownerName]->addItem(make_unique<Spell>(itemNameSpecific, characters[ownerName].get(), allowedTargets));
-                    cout << ownerName << " just obtained a new spell called " << itemNameSpecific << "." << endl;
-                }
+    size_t size() const { return count; }
+
+    // Visits the members in increasing id order.
+    template<typename Visit>
+    void forEach(Visit&& visit) const {
+        for (CharacterId id : sorted) {
+            visit(id);
+        }
+        for (size_t word = 0; word < bits.size(); ++word) {
+            for (uint64_t rest = bits[word]; rest; rest &= rest - 1) {
+                visit(CharacterId(word * 64 + countr_zero(rest)));
             }
         }
-    } else if (eventType == "Attack") {
-        string attackerName, targetName, weaponName;
-        iss >> attackerName >> targetName >> weaponName;
-        if (characters.find(attackerName) != characters.end() && characters.find(targetName) != characters.end()) {
-            dynamic_cast<WeaponUser*>(characters[attackerName].get())->attack(characters[targetName].get(), weaponName);
-            cout << attackerName << " attacks " << targetName << " with their " << weaponName << "!" << endl;
-        }
-    } else if (eventType == "Cast") {
-        string casterName, targetName, spellName;
-        iss >> casterName >> targetName >> spellName;
-        if (characters.find(casterName) != characters.end() && characters.find(targetName) != characters.end()) {
-            dynamic_cast<SpellUser*>(characters[casterName].get())->castSpell(spellName, characters[targetName].get());
-            cout << casterName << " casts " << spellName << " on " << targetName << "!" << endl;
-        }
-    } else if (eventType == "Drink") {
-        string supplierName, drinkerName, potionName;
-        iss >> supplierName >> drinkerName >> potionName;
-        if (characters.find(drinkerName) != characters.end()) {
-            dynamic_cast<PotionUser*>(characters[drinkerName].get())->drinkPotion(potionName, characters[drinkerName].get());
-            cout << drinkerName << " drinks " << potionName << " from " << supplierName << "." << endl;
-        }
-    }
-        // Continue from the previous implementation
-    else if (eventType == "Dialogue") {
-        string speaker;
-        int sp_len;
-        iss >> speaker >> sp_len;
-        string speech, word;
-        // Skip the initial space before the speech starts.
-        iss.ignore(std::numeric_limits<std::streamsize>::max(), ' ');
-        for (int i = 0; i < sp_len; ++i) {
-            iss >> word;
-            speech += word;
-            if (i < sp_len - 1) {
-                speech += " "; // Add space between words, but not after the last word.
-            }
-        }
-        cout << speaker << ": " << speech << endl;
-    }
-    else if (eventType == "Show") {
-        string showType;
-        iss >> showType;
-        if (showType == "characters") {
-            // Assuming characters are stored in an unordered_map and need sorting for display
-            vector<string> sortedNames;
-            if (showType == "characters") {
-                vector<string> sortedNames;
-                for (const auto& pair : characters) {
-                    if (pair.second->isAlive()) {
-                        sortedNames.push_back(pair.first + ":" + pair.second->getType() + ":" + to_string(pair.second->getHP()));
-                    }
-                }
-                sort(sortedNames.begin(), sortedNames.end());
-                for (const auto& name : sortedNames) {
-                    cout << name << " ";
-                }
-                cout << endl;
-            }
-        }
-        else if (showType == "weapons" || showType == "potions" || showType == "spells") {
-            string characterName;
-            iss >> characterName;
-            if (characters.find(characterName) != characters.end()) {
-                if (showType == "weapons") {
-                    dynamic_cast<WeaponUser*>(characters[characterName].get())->showWeapons();
-                } else if (showType == "potions") {
-                    dynamic_cast<PotionUser*>(characters[characterName].get())->showPotions();
-                } else if (showType == "spells") {
-                    dynamic_cast<SpellUser*>(characters[characterName].get())->showSpells();
-                }
+    }
+
+    bool hasMembers(const vector<CharacterId>& ids) const {
+        if (ids.size() != count) {
+            return false;
+        }
+        size_t i = 0;
+        bool same = true;
+        forEach([&](CharacterId id) { same = same && ids[i++] == id; });
+        return same;
+    }
+};
+
+// A reference to a set in the TargetSetTable: its slot, the generation the slot had
+// when the reference was taken, and the set itself, which does not move while
+// referenced.
+struct TargetSetRef {
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+    const TargetSet* set = nullptr;
+};
+
+// The targets a spell allows. Short lists are kept in the spell itself and checked by
+// a linear scan, which beats any lookup at that size; only lists longer than
+// inlineLimit are interned in the TargetSetTable, where sharing and the bitset pay for
+// the sort and the table entry.
+struct SpellTargets {
+    static constexpr uint32_t inlineLimit = 8;
+
+    uint32_t count = 0;                     // inline members, unused when shared
+    array<CharacterId, inlineLimit> ids{};  // inline members in increasing id order
+    TargetSetRef shared;                    // set is null for an inline list
+
+    bool isShared() const { return shared.set != nullptr; }
+
+    bool contains(CharacterId id) const {
+        if (isShared()) {
+            return shared.set->contains(id);
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (ids[i] == id) {
+                return true;
             }
         }
+        return false;
     }
-}
 
+    size_t size() const { return isShared() ? shared.set->size() : count; }
+
+    // Visits the members in increasing id order.
+    template<typename Visit>
+    void forEach(Visit&& visit) const {
+        if (isShared()) {
+            shared.set->forEach(visit);
+            return;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            visit(ids[i]);
+        }
+    }
+};
 
+// Drops the reference a spell held; see TargetSetTable::release.
+void releaseTargets(const TargetSetRef& ref);
 
-int main() {
-    string line;
-    while (getline(cin, line)) {
-        processEvent(line);
+class Spell : public PhysicalItem {
+    SpellTargets allowedTargets;  // owns one reference when shared
+public:
+    Spell(string name, CharacterHandle owner, SpellTargets allowedTargets)
+        : PhysicalItem(ItemKind::Spell, name, owner, false), allowedTargets(allowedTargets) {}
+    Spell(const Spell&) = delete;
+    Spell& operator=(const Spell&) = delete;
+    ~Spell() override {
+        if (allowedTargets.isShared()) {
+            releaseTargets(allowedTargets.shared);
+        }
     }
-    return 0;
-}
\ No newline at end of file
+
+    const SpellTargets& getAllowedTargets() const { return allowedTargets; }
+
+    // Only a stale owner is left to the caller to log; the other misses are logged here
+    // and still use the spell up.
+    ActionResult use(Character* user, Character* target) override {
+        if (user && !ownedBy(*user)) {
+            return ActionResult::MissingSpell;
+        }
+        if (!user || !user->isAlive()) {
+            noteOutcome(EventOutcome::NotAlive);
+            narrator().tell(Story::UserNotAlive, {});
+            return ActionResult::Done;
+        }
+        if (!target || !target->isAlive()) {
+            noteOutcome(EventOutcome::NotAlive);
+            narrator().tell(Story::TargetNotValid, {});
+            return ActionResult::Done;
+        }
+        if (!allowedTargets.contains(target->getId())) {
+            noteOutcome(EventOutcome::UnauthorizedTarget);
+            narrator().tell(Story::UnauthorizedCast, {*user, name, *target});
+            return ActionResult::Done;
+        }
+        narrator().tell(Story::Casts, {*user, name, *target});
+        return ActionResult::Done;
+    }
+
+    void setup() override {
+    }
+
+    void print(OutputSink& os) const override {
+        os << "Spell: " << name << '\n';
+    }
+};
+class Potion : public PhysicalItem {
+    int healValue;
+
+public:
+    Potion(string name, CharacterHandle owner, int healValue)
+        : PhysicalItem(ItemKind::Potion, name, owner, true) {
+        if (healValue <= 0) {
+            throw std::invalid_argument("Error caught: healValue must be positive.");
+        }
+        this->healValue = healValue;
+    }
+
+    int getHealValue() const { return healValue; }
+
+    ActionResult use(Character* user, Character* target) override {
+        if (user && !ownedBy(*user)) {
+            return ActionResult::MissingPotion;
+        }
+        if (user && user->isAlive() && target && target->isAlive() && isUsableOnce) {
+            target->heal(healValue);
+            narrator().tell(Story::Heals, {*user, name, *target, healValue});
+            isUsableOnce = false;
+        }
+        return ActionResult::Done;
+    }
+
+    void setup() override {
+    }
+
+    void print(OutputSink& os) const override {
+        os << "Potion: " << name << " HealValue: " << healValue << '\n';
+    }
+};
+
+
+
+
+
+
+
+
+
+class PotionUser {
+public:
+    [[nodiscard]] virtual ActionResult drinkPotion(string_view potionName, Character* target) = 0;
+    virtual void showPotions() const = 0;
+    virtual ~PotionUser() {}
+};
+
+
+
+class Weapon : public PhysicalItem{
+    int damage;
+
+public:
+    Weapon(string name, CharacterHandle owner, int damage)
+        : PhysicalItem(ItemKind::Weapon, name, owner, false) {
+        if (damage <= 0) {
+            throw std::invalid_argument("Error caught: damageValue must be positive.");
+        }
+        this->damage = damage;
+    }
+
+    int getDamage() const { return damage; }
+
+    ActionResult use(Character* user, Character* target) override {
+        if (user && !ownedBy(*user)) {
+            return ActionResult::MissingWeapon;
+        }
+        if (user && target) {
+            target->takeDamage(damage);
+            narrator().tell(Story::Attacks, {*user, *target, name, damage});
+        }
+        return ActionResult::Done;
+    }
+
+    // Lands up to blows blows on a living target, as that many use calls would, and
+    // stops after the one that kills it, setting blows to how many landed. Fails like
+    // use, before any blow, when the weapon is not the user's.
+    [[nodiscard]] ActionResult strike(Character* user, Character* target, int& blows) {
+        assert(user && target && target->isAlive());
+        if (!ownedBy(*user)) {
+            return ActionResult::MissingWeapon;
+        }
+        blows = min(blows, (target->getHP() - 1) / damage + 1);
+        if (blows > 1) {
+            // All but the last blow leave the target alive, so they land as one.
+            target->takeDamage((blows - 1) * damage);
+            narrator().tell(Story::Attacks, {*user, *target, name, damage}, size_t(blows - 1));
+        }
+        return use(user, target);
+    }
+
+    void setup() override {}
+
+    void print(OutputSink& os) const override {
+        os << "Weapon: " << name << " Damage: " << damage << '\n';
+    }
+};
+
+class WeaponUser {
+public:
+    // Makes up to blows attacks in a row and sets blows to how many were made: all of
+    // them, or fewer when one of them kills. Anything but Done means this attack and
+    // every one after it did nothing.
+    [[nodiscard]] virtual ActionResult attack(Character* target, string_view weaponName, int& blows) = 0;
+    virtual void showWeapons() = 0;
+    virtual ~WeaponUser() {}
+};
+
+class Fighter : public Character, public WeaponUser, public PotionUser {
+protected:
+    Container<Weapon> arsenal;
+    Container<Potion> medicalBag;
+public:
+
+    Fighter(CharacterId id, string name, int hp) : Character(CharacterKind::Fighter, id, name, hp), arsenal(3), medicalBag(5) {}
+    static constexpr unsigned carryMask = carries(ItemKind::Weapon) | carries(ItemKind::Potion);
+    string_view getTypeName() const override {
+        return "Fighter";}
+    void collectItems(vector<const PhysicalItem*>& items) const override {
+        arsenal.collect(items);
+        medicalBag.collect(items);
+    }
+    bool addItem(PoolPtr<PhysicalItem> item) override {
+        ItemKind kind = item->getKind();
+        if (!(carryMask & carries(kind))) {
+            return refuseItem(kind);
+        }
+        switch (kind) {
+            case ItemKind::Weapon: return arsenal.addItem(itemCast<Weapon>(std::move(item)));
+            case ItemKind::Potion: return medicalBag.addItem(itemCast<Potion>(std::move(item)));
+            default: break;
+        }
+
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::ItemNotSupported, {*this});
+        return false;
+    }
+    void showPotions() const override{
+        medicalBag.print();
+    }
+    ActionResult attack(Character* target, string_view weaponName, int& blows) override {
+        if (!this->isAlive()) {
+            return ActionResult::AttackerNotAlive;
+        }
+        if (!target || !target->isAlive()) {
+            return ActionResult::TargetNotValid;
+        }
+        Weapon* weapon = arsenal.getItem(weaponName);
+        if (!weapon) {
+            return ActionResult::MissingWeapon;
+        }
+        return weapon->strike(this, target, blows);
+    }
+
+    void showWeapons() override {
+        arsenal.print();
+    }
+    ActionResult drinkPotion(string_view potionName, Character* target) override {
+        if (!this->isAlive()) {
+            return ActionResult::DrinkerNotAlive;
+        }
+        Potion* potion = medicalBag.getItem(potionName);
+        if (!potion) {
+            return ActionResult::MissingPotion;
+        }
+        if (ActionResult result = potion->use(this, target); result != ActionResult::Done) {
+            return result;
+        }
+        medicalBag.removeItem(potionName); // Ensure the potion is removed after use.
+        return ActionResult::Done;
+    }
+    void print(OutputSink& os) const override {
+        Character::print(os); // Use Character's print and then add additional details if needed
+    }
+};
+
+
+
+
+
+class SpellUser {
+public:
+    // Anything but Done means the spell was not cast and is still held.
+    [[nodiscard]] virtual ActionResult castSpell(string_view spellName, Character* target) = 0;
+    virtual void showSpells() const = 0;
+    virtual ~SpellUser() {}
+};
+
+class Wizard : public Character, public SpellUser, public PotionUser{
+    Container<Spell> spellBook;
+    Container<Potion> medicalBag;
+
+public:
+    Wizard(CharacterId id, string name, int hp) : Character(CharacterKind::Wizard, id, name, hp), spellBook(10), medicalBag(10) {}
+
+    static constexpr unsigned carryMask = carries(ItemKind::Potion) | carries(ItemKind::Spell);
+
+    bool addItem(PoolPtr<PhysicalItem> item) override {
+        // First, check if the character can carry the item based on its type.
+        ItemKind kind = item->getKind();
+        if (!(carryMask & carries(kind))) {
+            return refuseItem(kind);
+        }
+
+        // Attempt to add the item to the appropriate container. Potions pass the check
+        // above but are not kept.
+        switch (kind) {
+            case ItemKind::Spell: return spellBook.addItem(itemCast<Spell>(std::move(item)));
+            default: return false;
+        }
+    }
+    string_view getTypeName() const override {
+        return "Wizard";}
+    void collectItems(vector<const PhysicalItem*>& items) const override {
+        spellBook.collect(items);
+        medicalBag.collect(items);
+    }
+
+
+
+//    bool addItem(std::unique_ptr<PhysicalItem> item) override {
+//        if (typeid(*item) == typeid(Weapon)) {
+//            narrator.logEvent("Error caught: Wizard " + getName() + " can't have weapons.");
+//            return false;
+//        } else if (typeid(*item) == typeid(Potion)) {
+//            auto potionPtr = static_cast<Potion*>(item.release());
+//            std::unique_ptr<Potion> potionUniquePtr(potionPtr);
+//            return medicalBag.addItem(std::move(potionUniquePtr));
+//        } else if (typeid(*item) == typeid(Spell)) {
+//            auto spellPtr = static_cast<Spell*>(item.release());
+//            std::unique_ptr<Spell> spellUniquePtr(spellPtr);
+//            return spellBook.addItem(std::move(spellUniquePtr));
+//        }
+//        narrator.logEvent("Error caught: Item type not supported for " + getName() + ".");
+//        return false;
+//    }
+
+    ActionResult castSpell(string_view spellName, Character* target) override {
+        Spell* spell = spellBook.getItem(spellName);
+        if (spell) {
+            if (ActionResult result = spell->use(this, target); result != ActionResult::Done) {
+                return result;
+            }
+            // Assuming the spell is used up and removed from the spell book
+            spellBook.removeItem(spellName);
+        } else {
+            noteOutcome(EventOutcome::MissingItem);
+        }
+        return ActionResult::Done;
+    }
+
+    void showSpells() const override {
+        spellBook.print();
+    }
+
+    ActionResult drinkPotion(string_view potionName, Character* target) override {
+        if (!this->isAlive()) {
+            return ActionResult::DrinkerNotAlive;
+        }
+        Potion* potion = medicalBag.getItem(potionName);
+        if (!potion) {
+            return ActionResult::MissingPotion;
+        }
+        if (ActionResult result = potion->use(this, target); result != ActionResult::Done) {
+            return result;
+        }
+        medicalBag.removeItem(potionName); // Ensure the potion is removed after use.
+        return ActionResult::Done;
+    }
+
+    void showPotions() const override{
+        medicalBag.print();
+    }
+
+    // Additional methods as needed
+};
+
+
+
+class Archer : public Character, public WeaponUser, public SpellUser,  public PotionUser {
+protected:
+    Container<Weapon> arsenal;
+    Container<Potion> medicalBag;
+    Container<Spell> spellBook;
+
+public:
+    Archer(CharacterId id, string name, int hp) : Character(CharacterKind::Archer, id, name, hp), arsenal(2), medicalBag(3), spellBook(2) {}
+    static constexpr unsigned carryMask = carries(ItemKind::Weapon) | carries(ItemKind::Potion) | carries(ItemKind::Spell);
+    bool addItem(PoolPtr<PhysicalItem> item) override {
+        ItemKind kind = item->getKind();
+        if (!(carryMask & carries(kind))) {
+            return refuseItem(kind);
+        }
+
+        switch (kind) {
+            case ItemKind::Weapon: return arsenal.addItem(itemCast<Weapon>(std::move(item)));
+            case ItemKind::Potion: return medicalBag.addItem(itemCast<Potion>(std::move(item)));
+            case ItemKind::Spell: return spellBook.addItem(itemCast<Spell>(std::move(item)));
+        }
+
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::ItemNotSupported, {*this});
+        return false;
+    }
+//    bool addItem(std::unique_ptr<PhysicalItem> item) override {
+//        if (typeid(*item) == typeid(Weapon)) {
+//            auto weaponPtr = static_cast<Weapon*>(item.release()); // Release ownership and cast
+//            std::unique_ptr<Weapon> weaponUniquePtr(weaponPtr); // Take ownership as the correct type
+//            return arsenal.addItem(std::move(weaponUniquePtr));
+//        } else if (typeid(*item) == typeid(Potion)) {
+//            auto potionPtr = static_cast<Potion*>(item.release()); // Release and cast
+//            std::unique_ptr<Potion> potionUniquePtr(potionPtr); // Take ownership as the correct type
+//            return medicalBag.addItem(std::move(potionUniquePtr));
+//        } else if (typeid(*item) == typeid(Spell)) {
+//            auto spellPtr = static_cast<Spell*>(item.release()); // Release and cast
+//            std::unique_ptr<Spell> spellUniquePtr(spellPtr); // Take ownership as the correct type
+//            return spellBook.addItem(std::move(spellUniquePtr));
+//        }
+//        narrator.logEvent("Error caught: Item type not supported for Archer " + getName() + ".");
+//        return false;
+//    }
+    string_view getTypeName() const override {
+        return "Archer";}
+    void collectItems(vector<const PhysicalItem*>& items) const override {
+        arsenal.collect(items);
+        medicalBag.collect(items);
+        spellBook.collect(items);
+    }
+    // Archers log their own misses, and the attack still counts as made.
+    ActionResult attack(Character* target, string_view weaponName, int& blows) override {
+        if (!target || !target->isAlive()) {
+            noteOutcome(EventOutcome::NotAlive);
+            narrator().tell(Story::NotAliveToAttack, {*this}, size_t(blows));
+            return ActionResult::Done;
+        }
+        Weapon* weapon = arsenal.getItem(weaponName);
+        if (!weapon || weapon->strike(this, target, blows) != ActionResult::Done) {
+            noteOutcome(EventOutcome::MissingItem);
+            narrator().tell(Story::MissingWeapon, {*this, weaponName}, size_t(blows));
+        }
+        return ActionResult::Done;
+    }
+
+    void showWeapons() override {
+        arsenal.print();
+    }
+
+    ActionResult castSpell(string_view spellName, Character* target) override {
+        if (this->isAlive()) {
+            Spell* spell = spellBook.getItem(spellName);
+            if (spell) {
+                if (ActionResult result = spell->use(this, target); result != ActionResult::Done) {
+                    return result;
+                }
+                spellBook.removeItem(spellName); // Remove the spell after use
+            } else {
+                noteOutcome(EventOutcome::MissingItem);
+            }
+        } else {
+            noteOutcome(EventOutcome::NotAlive);
+        }
+        return ActionResult::Done;
+    }
+
+    void showSpells() const override {
+        spellBook.print();
+    }
+
+    ActionResult drinkPotion(string_view potionName, Character* target) override {
+        if (!this->isAlive()) {
+            return ActionResult::DrinkerNotAlive;
+        }
+        Potion* potion = medicalBag.getItem(potionName);
+        if (!potion) {
+            return ActionResult::MissingPotion;
+        }
+        if (ActionResult result = potion->use(this, target); result != ActionResult::Done) {
+            return result;
+        }
+        medicalBag.removeItem(potionName); // Ensure the potion is removed after use.
+        return ActionResult::Done;
+    }
+
+    void showPotions() const override {
+        medicalBag.print();
+    }
+
+};
+
+
+
+
+
+//сделать массив имен и обращаться к объекту по имени перса 2) сделать проверку в weapon user
+
+
+// Interns character names: each name gets a dense ID the first time a character with
+// that name is created and keeps it when the character is re-created.
+class NameTable {
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(string_view name) const { return hash<string_view>{}(name); }
+    };
+    unordered_map<string, CharacterId, NameHash, equal_to<>> ids;
+    vector<const string*> names;  // indexed by CharacterId, the keys above
+
+public:
+    CharacterId find(string_view name) const {
+        auto it = ids.find(name);
+        return it != ids.end() ? it->second : noCharacter;
+    }
+
+    CharacterId intern(string_view name) {
+        auto [it, inserted] = ids.try_emplace(string(name), CharacterId(ids.size()));
+        if (inserted) {
+            names.push_back(&it->first);
+        }
+        return it->second;
+    }
+
+    const string& nameOf(CharacterId id) const { return *names[id]; }
+
+    size_t size() const { return ids.size(); }
+    void reserve(size_t count) {
+        ids.reserve(count);
+        names.reserve(count);
+    }
+};
+
+// One pool per concrete character and item type. Everything a world creates comes
+// from here, so a finished world can be torn down and its memory reused in one step.
+class WorldArena {
+    ObjectPool<Weapon> weapons;
+    ObjectPool<Potion> potions;
+    ObjectPool<Spell> spells;
+    ObjectPool<Fighter> fighters;
+    ObjectPool<Wizard> wizards;
+    ObjectPool<Archer> archers;
+    mutex guard;
+
+    template<typename T>
+    ObjectPool<T>& pool() {
+        if constexpr (is_same_v<T, Weapon>) return weapons;
+        else if constexpr (is_same_v<T, Potion>) return potions;
+        else if constexpr (is_same_v<T, Spell>) return spells;
+        else if constexpr (is_same_v<T, Fighter>) return fighters;
+        else if constexpr (is_same_v<T, Wizard>) return wizards;
+        else return archers;
+    }
+
+public:
+    template<typename T, typename... Args>
+    PoolPtr<T> make(Args&&... args) {
+        ObjectPool<T>& from = pool<T>();
+        void* storage = from.allocate();
+        try {
+            return PoolPtr<T>(new (storage) T(std::forward<Args>(args)...), PoolDeleter{&from});
+        } catch (...) {
+            from.deallocate(storage);
+            throw;
+        }
+    }
+
+    // Lets events on several threads create and destroy objects at once.
+    void setShared(bool shared) {
+        for (PoolBase* each : initializer_list<PoolBase*>{&weapons, &potions, &spells, &fighters, &wizards, &archers}) {
+            each->guard = shared ? &guard : nullptr;
+        }
+    }
+
+    // Makes every slab available again. Only valid once every object is destroyed.
+    void reset() {
+        weapons.reset();
+        potions.reset();
+        spells.reset();
+        fighters.reset();
+        wizards.reset();
+        archers.reset();
+    }
+
+    void printStats(ostream& os) const {
+        auto line = [&os](const char* name, PoolStats stats) {
+            os << name << ": live " << stats.live << ", high-water " << stats.highWater
+               << ", slots " << stats.slots << endl;
+        };
+        line("weapons", weapons.stats());
+        line("potions", potions.stats());
+        line("spells", spells.stats());
+        line("fighters", fighters.stats());
+        line("wizards", wizards.stats());
+        line("archers", archers.stats());
+    }
+};
+
+// Living characters in "Show characters" order, that is by the string name:type:hp.
+// Each entry keeps its "name:type:" prefix rendered; the HP digits are read from the
+// vitals store while showing. Kept up to date as characters are created and killed,
+// so showing them is a walk over the set with no sorting and no string building.
+class ShowIndex {
+    struct Entry {
+        CharacterId id;
+        string prefix;
+        mutable int hp;  // HP the entry was ordered by; only kept current while hpAffectsOrder
+
+        bool operator<(const Entry& other) const {
+            size_t common = min(prefix.size(), other.prefix.size());
+            if (int c = prefix.compare(0, common, other.prefix, 0, common)) {
+                return c < 0;
+            }
+            return prefix + to_string(hp) < other.prefix + to_string(other.hp);
+        }
+    };
+
+    using Entries = set<Entry>;
+    Entries entries;
+    vector<Entries::iterator> positions;  // indexed by CharacterId, end() when absent
+    // Names are unique, so one prefix can only start another, and HP take part in the
+    // order, when a name continues with ':' past the end of another name.
+    bool hpAffectsOrder = false;
+
+public:
+    void remove(CharacterId id) {
+        if (id < positions.size() && positions[id] != entries.end()) {
+            entries.erase(positions[id]);
+            positions[id] = entries.end();
+        }
+    }
+
+    void update(const Character& character) {
+        CharacterId id = character.getId();
+        if (id >= positions.size()) {
+            positions.resize(id + 1, entries.end());
+        }
+        Entries::iterator& position = positions[id];
+        if (!character.isAlive()) {
+            remove(id);
+        } else if (position == entries.end()) {
+            if (!hpAffectsOrder && character.getName().find(':') != string::npos) {
+                hpAffectsOrder = true;
+                for (const Entry& entry : entries) {
+                    entry.hp = vitals().getHP(entry.id);
+                }
+            }
+            string prefix;
+            prefix.reserve(character.getName().size() + 9);
+            prefix.append(character.getName()).append(1, ':').append(character.getTypeName()).append(1, ':');
+            position = entries.insert({id, std::move(prefix), character.getHP()}).first;
+        } else if (hpAffectsOrder) {
+            auto node = entries.extract(position);
+            node.value().hp = character.getHP();
+            position = entries.insert(std::move(node)).position;
+        }
+    }
+
+    // Indexes every live character of a freshly built world at once, in one linear
+    // build instead of a tree insertion per character. order is the index as it was
+    // saved; it is only trusted when it lists exactly the live characters in order,
+    // otherwise they are sorted here.
+    void assign(const vector<PoolPtr<Character>>& all, span<const CharacterId> order) {
+        vector<Entry> sorted;
+        sorted.reserve(order.size());
+        auto add = [&](const Character& character) {
+            string prefix;
+            prefix.reserve(character.getName().size() + 9);
+            prefix.append(character.getName()).append(1, ':').append(character.getTypeName()).append(1, ':');
+            hpAffectsOrder = hpAffectsOrder || character.getName().find(':') != string::npos;
+            sorted.push_back({character.getId(), std::move(prefix), character.getHP()});
+        };
+        size_t living = count_if(all.begin(), all.end(), [](const auto& character) { return character->isAlive(); });
+        bool trusted = order.size() == living;
+        for (size_t i = 0; trusted && i < order.size(); ++i) {
+            trusted = order[i] < all.size() && all[order[i]]->isAlive();
+            if (trusted) {
+                add(*all[order[i]]);
+                trusted = i == 0 || sorted[i - 1] < sorted[i];
+            }
+        }
+        if (!trusted) {
+            sorted.clear();
+            for (const auto& character : all) {
+                if (character->isAlive()) {
+                    add(*character);
+                }
+            }
+            sort(sorted.begin(), sorted.end());
+        }
+        entries.clear();
+        positions.assign(all.size(), entries.end());
+        for (Entry& entry : sorted) {
+            CharacterId id = entry.id;
+            positions[id] = entries.emplace_hint(entries.end(), std::move(entry));
+        }
+    }
+
+    vector<CharacterId> order() const {
+        vector<CharacterId> ids;
+        ids.reserve(entries.size());
+        for (const Entry& entry : entries) {
+            ids.push_back(entry.id);
+        }
+        return ids;
+    }
+
+    bool ordersByHp() const { return hpAffectsOrder; }
+
+    template<typename Visit>
+    void forEach(Visit&& visit) const {
+        for (const Entry& entry : entries) {
+            visit(string_view(entry.prefix), vitals().getHP(entry.id));
+        }
+    }
+};
+
+enum class EventType : uint8_t {
+    None,
+    CreateCharacter,
+    CreateWeapon,
+    CreatePotion,
+    CreateSpell,
+    Attack,
+    Cast,
+    Drink,
+    Dialogue,
+    ShowCharacters,
+    ShowWeapons,
+    ShowPotions,
+    ShowSpells,
+    AreaDamage,
+    AreaHeal,
+    RepeatAttack,
+    RepeatCast,
+    Volley,
+    Poison,
+    Regenerate,
+    DelayCast,
+    Wait,
+    Count
+};
+
+// Counters and latency histograms per event type, filled in by dispatchEvent in
+// metrics builds. Latencies land in log-linear buckets, four per power of two, so a
+// percentile read back from them is at most 25% above the true value.
+class EventMetrics {
+public:
+    static constexpr size_t bucketCount = 252;
+
+    struct TypeStats {
+        array<uint64_t, size_t(EventOutcome::Count)> outcomes{};
+        array<uint64_t, bucketCount> latency{};
+        chrono::nanoseconds total{0};
+        chrono::nanoseconds longest{0};
+
+        uint64_t events() const {
+            uint64_t count = 0;
+            for (uint64_t n : outcomes) {
+                count += n;
+            }
+            return count;
+        }
+
+        // Upper end of the bucket holding the given fraction of events, in ns, but no
+        // more than the longest event seen.
+        uint64_t percentile(double fraction) const {
+            uint64_t rank = uint64_t(fraction * events()), seen = 0;
+            for (size_t bucket = 0; bucket < bucketCount; ++bucket) {
+                seen += latency[bucket];
+                if (seen > rank) {
+                    return min(bucketLimit(bucket), uint64_t(longest.count()));
+                }
+            }
+            return uint64_t(longest.count());
+        }
+    };
+
+    static size_t bucketOf(uint64_t ns) {
+        if (ns < 4) {
+            return ns;
+        }
+        int exponent = bit_width(ns) - 1;
+        return (exponent - 1) * 4 + ((ns >> (exponent - 2)) & 3);
+    }
+
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < 4) {
+            return bucket;
+        }
+        int exponent = int(bucket / 4) + 1;
+        return ((4 + bucket % 4 + 1) << (exponent - 2)) - 1;
+    }
+
+    void begin() { outcome = EventOutcome::Success; }
+
+    void note(EventOutcome failure) {
+        if (outcome == EventOutcome::Success) {
+            outcome = failure;
+        }
+    }
+
+    void record(EventType type, chrono::nanoseconds elapsed, bool threw = false) {
+        TypeStats& stats = types[size_t(type)];
+        ++stats.outcomes[size_t(threw ? EventOutcome::Exception : outcome)];
+        ++stats.latency[bucketOf(uint64_t(max<int64_t>(elapsed.count(), 0)))];
+        stats.total += elapsed;
+        stats.longest = max(stats.longest, elapsed);
+        ++recorded;
+    }
+
+    const TypeStats& stats(EventType type) const { return types[size_t(type)]; }
+    uint64_t events() const { return recorded; }
+    chrono::steady_clock::duration uptime() const { return chrono::steady_clock::now() - started; }
+
+    // Periodic reports go to path every interval, checked every few hundred events.
+    bool openReport(const char* path, chrono::milliseconds every) {
+        report.open(path, ios::trunc);
+        interval = every;
+        nextReport = chrono::steady_clock::now() + interval;
+        return report.is_open();
+    }
+
+    ostream* reportDue() {
+        if (!report.is_open() || ++sinceCheck < 256) {
+            return nullptr;
+        }
+        sinceCheck = 0;
+        auto now = chrono::steady_clock::now();
+        if (now < nextReport) {
+            return nullptr;
+        }
+        nextReport = now + interval;
+        return &report;
+    }
+
+    ostream* finalReport() { return report.is_open() ? &report : nullptr; }
+
+private:
+    array<TypeStats, size_t(EventType::Count)> types{};
+    EventOutcome outcome = EventOutcome::Success;
+    uint64_t recorded = 0;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    ofstream report;
+    chrono::milliseconds interval{1000};
+    chrono::steady_clock::time_point nextReport;
+    unsigned sinceCheck = 0;
+};
+
+// Hands out one TargetSet per distinct member list while any spell still uses it.
+// Sets live in slots with a plain reference count, one per spell; a slot that drops to
+// zero is freed for reuse under the next generation, so stale references (such as
+// those remembered by text) are told apart in constant time. Text events with long
+// lists can also be looked up by the raw names they list, which skips resolving every
+// name again when the same list is repeated.
+class TargetSetTable {
+    struct TextHash {
+        using is_transparent = void;
+        size_t operator()(string_view text) const { return hash<string_view>{}(text); }
+    };
+    struct Slot {
+        unique_ptr<const TargetSet> set;  // null while free
+        uint32_t generation = 0;
+        uint32_t references = 0;
+        uint64_t membersHash = 0;
+        vector<string> texts;  // byText keys that lead here
+    };
+    vector<Slot> slots;
+    vector<uint32_t> freeSlots;
+    unordered_map<uint64_t, vector<uint32_t>> byMembers;  // slots by members hash
+    unordered_map<string, TargetSetRef, TextHash, equal_to<>> byText;  // live sets only
+
+    static uint64_t hashMembers(const vector<CharacterId>& ids) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (CharacterId id : ids) {
+            h = (h ^ id) * 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    TargetSetRef acquire(uint32_t index) {
+        Slot& slot = slots[index];
+        ++slot.references;
+        return {index, slot.generation, slot.set.get()};
+    }
+
+public:
+    // ids in any order, duplicates allowed. The caller owns one reference.
+    TargetSetRef intern(vector<CharacterId> ids) {
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        uint64_t membersHash = hashMembers(ids);
+        vector<uint32_t>& bucket = byMembers[membersHash];
+        for (uint32_t index : bucket) {
+            if (slots[index].set->hasMembers(ids)) {
+                return acquire(index);
+            }
+        }
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            index = uint32_t(slots.size());
+            slots.emplace_back();
+        }
+        Slot& slot = slots[index];
+        slot.set = make_unique<const TargetSet>(std::move(ids));
+        slot.membersHash = membersHash;
+        bucket.push_back(index);
+        return acquire(index);
+    }
+
+    // Another reference to a set the caller already holds one to.
+    void retain(const TargetSetRef& ref) {
+        assert(slots[ref.slot].generation == ref.generation);
+        ++slots[ref.slot].references;
+    }
+
+    void release(const TargetSetRef& ref) {
+        Slot& slot = slots[ref.slot];
+        assert(slot.generation == ref.generation && slot.references > 0);
+        if (--slot.references) {
+            return;
+        }
+        auto bucket = byMembers.find(slot.membersHash);
+        erase(bucket->second, ref.slot);
+        if (bucket->second.empty()) {
+            byMembers.erase(bucket);
+        }
+        for (const string& text : slot.texts) {
+            byText.erase(text);
+        }
+        slot.texts.clear();
+        slot.set.reset();
+        ++slot.generation;
+        freeSlots.push_back(ref.slot);
+    }
+
+    // Only lists whose names all named characters may be remembered: later events
+    // cannot change what they resolve to, since ids are never reused. A found set
+    // hands the caller one reference.
+    optional<TargetSetRef> findText(string_view names) {
+        auto it = byText.find(names);
+        if (it == byText.end()) {
+            return nullopt;
+        }
+        assert(slots[it->second.slot].generation == it->second.generation);
+        return acquire(it->second.slot);
+    }
+
+    void rememberText(string_view names, const TargetSetRef& ref) {
+        auto [it, inserted] = byText.try_emplace(string(names), ref);
+        if (inserted) {
+            slots[ref.slot].texts.push_back(it->first);
+        }
+    }
+};
+
+// Delayed and periodic effects against characters, kept in a hierarchical timing
+// wheel on a turn clock that only Wait events move. Level L has 64 slots for bits
+// 6L..6L+5 of the due turn; an effect sits at the level of the highest bit where its
+// due turn differs from the clock, so scheduling and cancelling are O(1). Advancing
+// jumps straight to the next occupied slot and moves that slot's effects one level
+// down when it comes up, so quiet stretches of time cost nothing. Each effect is also
+// on a list of its target's effects, dropped whole when the target dies.
+class EffectWheel {
+public:
+    enum class Kind : uint8_t { Poison, Regeneration, DelayedCast };
+
+    // Poison and regeneration hit or heal the target by amount every period turns for
+    // ticks turns; a delayed cast has the caster cast the spell once.
+    struct Effect {
+        uint64_t due = 0;        // turn it next takes place in
+        uint64_t sequence = 0;   // scheduling order, which breaks ties within a turn
+        CharacterHandle target;
+        CharacterHandle caster;  // delayed casts only
+        uint32_t spell = 0;      // delayed casts only: index into the spell names
+        int amount = 0;
+        int period = 0;
+        int ticks = 0;           // ticks still to come, the next one included
+        Kind kind = Kind::Poison;
+    };
+
+private:
+    static constexpr size_t slotBits = 6;
+    static constexpr size_t slotCount = size_t(1) << slotBits;
+    static constexpr size_t levelCount = (64 + slotBits - 1) / slotBits;
+    static constexpr uint32_t none = numeric_limits<uint32_t>::max();
+
+    struct Links {
+        uint32_t prev, next;
+    };
+
+    // Slot lists and target lists are circular, each with a head node of its own. The
+    // first levelCount * slotCount nodes are the slot heads.
+    struct Node {
+        Links wheel;
+        Links owner;
+        Effect effect;
+    };
+
+    vector<Node> nodes;
+    vector<uint32_t> ownerHeads;  // by CharacterId
+    uint32_t freeNodes = none;    // chained through wheel.next
+    array<uint64_t, levelCount> occupied{};
+    uint64_t turn = 0;
+    uint64_t scheduled = 0;
+    size_t live = 0;
+    NameTable spellNames;
+
+    template<Links Node::*list>
+    void link(uint32_t head, uint32_t index) {
+        uint32_t tail = (nodes[head].*list).prev;
+        nodes[index].*list = {tail, head};
+        (nodes[tail].*list).next = index;
+        (nodes[head].*list).prev = index;
+    }
+
+    template<Links Node::*list>
+    void unlink(uint32_t index) {
+        Links links = nodes[index].*list;
+        (nodes[links.prev].*list).next = links.next;
+        (nodes[links.next].*list).prev = links.prev;
+    }
+
+    uint32_t allocate() {
+        if (freeNodes == none) {
+            nodes.emplace_back();
+            return uint32_t(nodes.size() - 1);
+        }
+        uint32_t index = freeNodes;
+        freeNodes = nodes[index].wheel.next;
+        return index;
+    }
+
+    void release(uint32_t index) {
+        nodes[index].wheel.next = freeNodes;
+        freeNodes = index;
+        --live;
+    }
+
+    uint32_t ownerHead(CharacterId id) {
+        if (id >= ownerHeads.size()) {
+            ownerHeads.resize(id + 1, none);
+        }
+        if (ownerHeads[id] == none) {
+            uint32_t head = allocate();
+            nodes[head].owner = {head, head};
+            ownerHeads[id] = head;
+        }
+        return ownerHeads[id];
+    }
+
+    // The bits of turn above the digit of level.
+    static uint64_t above(uint64_t turn, size_t level) {
+        size_t bits = (level + 1) * slotBits;
+        return bits >= 64 ? 0 : turn >> bits << bits;
+    }
+
+    // The head of the slot for an effect due then. An effect stays in the right slot
+    // while the clock moves, up to the turn its slot comes up.
+    uint32_t slotHead(uint64_t due) const {
+        uint64_t differs = due ^ turn;
+        size_t level = differs ? (bit_width(differs) - 1) / slotBits : 0;
+        return uint32_t(level * slotCount + ((due >> (level * slotBits)) & (slotCount - 1)));
+    }
+
+    void place(uint32_t index) {
+        uint32_t head = slotHead(nodes[index].effect.due);
+        link<&Node::wheel>(head, index);
+        occupied[head / slotCount] |= uint64_t(1) << (head % slotCount);
+    }
+
+    void unplace(uint32_t index) {
+        uint32_t head = slotHead(nodes[index].effect.due);
+        unlink<&Node::wheel>(index);
+        if (nodes[head].wheel.next == head) {
+            occupied[head / slotCount] &= ~(uint64_t(1) << (head % slotCount));
+        }
+    }
+
+public:
+    EffectWheel() : nodes(levelCount * slotCount) {
+        for (uint32_t head = 0; head < nodes.size(); ++head) {
+            nodes[head].wheel = {head, head};
+        }
+    }
+
+    uint64_t now() const { return turn; }
+    size_t pending() const { return live; }
+
+    uint32_t internSpell(string_view name) { return spellNames.intern(name); }
+    const string& spellName(uint32_t spell) const { return spellNames.nameOf(spell); }
+
+    // Adds an effect due after the current turn.
+    void schedule(Effect effect) {
+        assert(effect.due > turn);
+        uint32_t head = ownerHead(effect.target.id);
+        uint32_t index = allocate();
+        effect.sequence = scheduled++;
+        nodes[index].effect = effect;
+        place(index);
+        link<&Node::owner>(head, index);
+        ++live;
+    }
+
+    // Drops every effect against the character.
+    void cancel(CharacterId id) {
+        if (id >= ownerHeads.size() || ownerHeads[id] == none) {
+            return;
+        }
+        uint32_t head = ownerHeads[id];
+        for (uint32_t index; (index = nodes[head].owner.next) != head;) {
+            unlink<&Node::owner>(index);
+            unplace(index);
+            release(index);
+        }
+    }
+
+    // Moves the clock forward by turns, running every effect that comes due on the way
+    // in turn order and, within a turn, in the order they were scheduled. fire may
+    // change the effect and returns whether it comes due again period turns later; it
+    // may cancel effects but not schedule new ones.
+    template<typename Fire>
+    void advance(uint64_t turns, Fire fire) {
+        uint64_t until = turn + turns;
+        for (;;) {
+            size_t level = 0;
+            while (level < levelCount && !occupied[level]) {
+                ++level;
+            }
+            if (level == levelCount) {
+                break;
+            }
+            size_t slot = countr_zero(occupied[level]);
+            uint64_t start = above(turn, level) | uint64_t(slot) << (level * slotBits);
+            if (start > until) {
+                break;
+            }
+            turn = start;
+            uint32_t head = uint32_t(level * slotCount + slot);
+            occupied[level] &= ~(uint64_t(1) << slot);
+            for (uint32_t index; (index = nodes[head].wheel.next) != head;) {
+                unlink<&Node::wheel>(index);
+                if (level > 0) {
+                    place(index);  // the clock is at the slot's start, so a lower level
+                    continue;
+                }
+                unlink<&Node::owner>(index);
+                Effect effect = nodes[index].effect;
+                if (!fire(effect)) {
+                    release(index);
+                    continue;
+                }
+                effect.due = turn + uint64_t(effect.period);
+                effect.sequence = scheduled++;
+                nodes[index].effect = effect;
+                place(index);
+                link<&Node::owner>(ownerHead(effect.target.id), index);
+            }
+        }
+        turn = until;
+    }
+
+    // Every pending effect, in the order they will take place.
+    vector<Effect> collect() const {
+        vector<Effect> effects;
+        effects.reserve(live);
+        for (uint32_t head : ownerHeads) {
+            if (head != none) {
+                for (uint32_t index = nodes[head].owner.next; index != head; index = nodes[index].owner.next) {
+                    effects.push_back(nodes[index].effect);
+                }
+            }
+        }
+        sort(effects.begin(), effects.end(), [](const Effect& a, const Effect& b) {
+            return a.due != b.due ? a.due < b.due : a.sequence < b.sequence;
+        });
+        return effects;
+    }
+
+    // For restoring a snapshot into an empty wheel.
+    void setNow(uint64_t restored) {
+        assert(!live);
+        turn = restored;
+    }
+};
+
+struct EventCapture;
+
+// Streaming mode (--retire-dead=N) for endless runs: a character that has been dead for
+// N events is retired. Its object and items go back to the pools; name, kind and HP
+// are still in the name table and vitals, and whatever it carried is packed into one
+// string. The next event that looks the name up gets it rebuilt exactly as it was.
+// Only living and recently touched dead characters keep objects, so memory follows
+// the live population; each name ever created still costs its entries in the name
+// table, the vitals and the vectors indexed by id.
+class CharacterReaper {
+    uint64_t grace = 0;   // 0 when off
+    uint64_t events = 0;  // events run so far
+    deque<pair<CharacterHandle, uint64_t>> dying;  // deaths in order, with the event count then
+    unordered_map<CharacterId, string> retired;
+    unique_ptr<EventCapture> quiet;  // swallows the teardown lines of retiring characters
+
+public:
+    ~CharacterReaper();
+
+    void enable(uint64_t graceEvents) { grace = graceEvents; }
+
+    void noteDeath(CharacterHandle handle) {
+        if (grace) {
+            dying.emplace_back(handle, events);
+        }
+    }
+
+    void afterEvent() {
+        if (!grace) {
+            return;
+        }
+        ++events;
+        while (!dying.empty() && dying.front().second + grace <= events) {
+            CharacterHandle handle = dying.front().first;
+            dying.pop_front();
+            retire(handle);
+        }
+    }
+
+    // Retires the character if it is still the dead incarnation the handle names.
+    void retire(CharacterHandle handle);
+    Character* rebuild(CharacterId id);
+    // Rebuilds and destroys every retired character, so that it prints its teardown
+    // lines like any other.
+    void releaseAll();
+};
+
+// Everything one simulation owns. Worlds share nothing, so independent scenarios can
+// run on different threads at once; code reaches the world it is running in through
+// the thread's activeWorld. Members are destroyed bottom up: characters print their
+// teardown lines to a console that is still open and free their slots into pools and
+// their spells' target sets into a table that still exist. A world may borrow an
+// arena that outlives it, so that the next world reuses its slabs after a reset().
+struct World {
+    EventMetrics metrics;
+    Narrator narrator;
+    OutputSink console;
+    VitalsStore vitals;
+    NameTable characterNames;
+    WorldArena ownArena;  // unused when the arena is borrowed
+    WorldArena& arena;
+    TargetSetTable targetSets;
+    vector<PoolPtr<Character>> characters;  // indexed by CharacterId, null while retired
+    ShowIndex showIndex;
+    EffectWheel effects;
+    CharacterReaper reaper;
+
+    World(const string& logPath, int outputFd, WorldArena* borrowed = nullptr)
+        : narrator(logPath), console(outputFd), arena(borrowed ? *borrowed : ownArena) {}
+    World(const string& logPath, const string& outputPath, WorldArena* borrowed = nullptr)
+        : narrator(logPath), console(outputPath), arena(borrowed ? *borrowed : ownArena) {}
+    ~World() { reaper.releaseAll(); }
+};
+
+thread_local World* activeWorld = nullptr;
+
+// Output of events running on a parallel worker, kept until each event's turn to be
+// committed, the characters whose health they changed or who died and the target sets
+// their spells let go of; see ParallelExecutor.
+struct EventCapture {
+    string consoleText;
+    string storyText;
+    vector<CharacterId> healthChanges;
+    vector<CharacterId> deaths;
+    vector<TargetSetRef> releasedTargets;
+    OutputSink console{consoleText, 4096};
+    Narrator narrator{storyText};
+};
+
+thread_local EventCapture* activeCapture = nullptr;
+
+Narrator& narrator() { return activeCapture ? activeCapture->narrator : activeWorld->narrator; }
+OutputSink& console() { return activeCapture ? activeCapture->console : activeWorld->console; }
+VitalsStore& vitals() { return activeWorld->vitals; }
+NameTable& characterNames() { return activeWorld->characterNames; }
+WorldArena& arena() { return activeWorld->arena; }
+vector<PoolPtr<Character>>& characters() { return activeWorld->characters; }
+ShowIndex& showIndex() { return activeWorld->showIndex; }
+EventMetrics& metrics() { return activeWorld->metrics; }
+TargetSetTable& targetSets() { return activeWorld->targetSets; }
+EffectWheel& effects() { return activeWorld->effects; }
+CharacterReaper& reaper() { return activeWorld->reaper; }
+
+void noteOutcome(EventOutcome outcome) {
+    if constexpr (eventMetrics) {
+        metrics().note(outcome);
+    }
+}
+
+// The Show index is shared by every character, so workers leave the update to the
+// commit of their event.
+void healthChanged(const Character& character) {
+    if (activeCapture) {
+        activeCapture->healthChanges.push_back(character.getId());
+    } else {
+        showIndex().update(character);
+    }
+}
+
+// Effects against the dead are dropped; workers leave that to the commit as well.
+void characterDied(const Character& character) {
+    reaper().noteDeath(character.getHandle());
+    if (activeCapture) {
+        activeCapture->deaths.push_back(character.getId());
+    } else {
+        effects().cancel(character.getId());
+    }
+}
+
+// So is the target set table; a worker's released sets stay referenced until the
+// commit of its run.
+void releaseTargets(const TargetSetRef& ref) {
+    if (activeCapture) {
+        activeCapture->releasedTargets.push_back(ref);
+    } else {
+        targetSets().release(ref);
+    }
+}
+
+// Splits an event line into whitespace separated tokens in place. Extraction follows
+// the rules of istringstream (a failed read poisons every later read, numbers stop
+// at the first non-digit) so malformed lines behave exactly as they always did.
+class Tokenizer {
+    string_view text;
+    size_t pos = 0;
+    bool failed = false;
+
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+    void skipSpaces() {
+        while (pos < text.size() && isSpace(text[pos])) {
+            ++pos;
+        }
+    }
+public:
+    Tokenizer() = default;
+    explicit Tokenizer(string_view text) : text(text) {}
+
+    // Like `iss >> word`: the token is left untouched when nothing is left to read.
+    bool next(string_view& token) {
+        if (failed) {
+            return false;
+        }
+        skipSpaces();
+        if (pos == text.size()) {
+            failed = true;
+            return false;
+        }
+        size_t start = pos;
+        while (pos < text.size() && !isSpace(text[pos])) {
+            ++pos;
+        }
+        token = text.substr(start, pos - start);
+        return true;
+    }
+
+    // Like `iss >> number`: reads an optionally signed decimal prefix, stores 0 when
+    // there are no digits and clamps on overflow, failing the stream in both cases.
+    bool nextInt(int& value) {
+        if (failed) {
+            return false;
+        }
+        skipSpaces();
+        if (pos == text.size()) {
+            failed = true;
+            return false;
+        }
+        size_t start = pos;
+        if (text[start] == '+' && start + 1 < text.size() && text[start + 1] != '-') {
+            ++start;
+        }
+        const char* first = text.data() + start;
+        const char* last = text.data() + text.size();
+        auto [ptr, ec] = from_chars(first, last, value);
+        if (ec == errc::invalid_argument) {
+            value = 0;
+            failed = true;
+            return false;
+        }
+        pos = ptr - text.data();
+        if (ec == errc::result_out_of_range) {
+            value = *first == '-' ? numeric_limits<int>::min() : numeric_limits<int>::max();
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Like `iss.ignore(max, delim)`: skips everything up to and including delim.
+    void skipPast(char delim) {
+        if (failed) {
+            return;
+        }
+        size_t found = text.find(delim, pos);
+        pos = found == string_view::npos ? text.size() : found + 1;
+    }
+};
+
+// Maps a fixed set of short tokens to values through a perfect hash found at compile
+// time: length, first, middle and last byte times a searched multiplier pick the slot,
+// and one string compare confirms the hit.
+template<typename Value, size_t N>
+class KeywordMap {
+    static constexpr int bits = bit_width(N * 4 - 1);
+    static constexpr size_t tableSize = size_t(1) << bits;
+
+    struct Slot {
+        string_view key;
+        Value value{};
+    };
+    array<Slot, tableSize> slots{};
+    uint32_t seed = 0;
+
+    static constexpr uint32_t slotOf(string_view key, uint32_t seed) {
+        uint32_t h = uint32_t(key.size()) << 24 | uint32_t(uint8_t(key.front())) << 16
+                   | uint32_t(uint8_t(key[key.size() / 2])) << 8 | uint8_t(key.back());
+        return (h * seed) >> (32 - bits);
+    }
+
+public:
+    constexpr KeywordMap(const array<pair<string_view, Value>, N>& entries) {
+        for (seed = 1; ; seed += 2) {
+            array<bool, tableSize> taken{};
+            bool collision = false;
+            for (const auto& entry : entries) {
+                if (entry.first.empty() || taken[slotOf(entry.first, seed)]) {
+                    collision = true;
+                    break;
+                }
+                taken[slotOf(entry.first, seed)] = true;
+            }
+            if (!collision) {
+                break;
+            }
+            if (seed > 100000) {
+                throw logic_error("no perfect hash for these keywords");
+            }
+        }
+        for (const auto& entry : entries) {
+            slots[slotOf(entry.first, seed)] = {entry.first, entry.second};
+        }
+    }
+
+    constexpr const Value* find(string_view key) const {
+        if (key.empty()) {
+            return nullptr;
+        }
+        const Slot& slot = slots[slotOf(key, seed)];
+        return slot.key == key ? &slot.value : nullptr;
+    }
+};
+
+// One parsed line. All views point into the line handed to parseEvent, so a record
+// must not outlive it.
+struct EventRecord {
+    EventType type = EventType::None;
+    string_view kind;     // class name of Create character or area effect selector, as written
+    string_view subject;  // new character, item owner, attacker, caster, drinker or speaker
+    string_view object;   // attack/cast target or potion supplier
+    string_view item;     // weapon, potion or spell name
+    int value = 0;        // initial HP, damage, heal value, spell target count, word count, area amount, repeat count,
+                          // effect amount or turns
+    int period = 0;       // turns between effect ticks
+    int ticks = 0;        // number of effect ticks
+    Tokenizer rest;       // spell targets, dialogue words, area effect list or volley targets, read on demand
+
+    // Compiled events arrive with their names already mapped to characters and their
+    // word lists already split, so handlers neither look up nor tokenize anything.
+    bool compiled = false;
+    CharacterId subjectId = noCharacter;
+    CharacterId objectId = noCharacter;
+    span<const CharacterId> targetIds;  // spell or area list targets that exist
+    span<const string_view> words;      // dialogue words as written, at most value
+};
+
+// Argument readers for the table in eventSpecs; each picks up right after the verb
+// and subcommand words.
+void parseCharacterArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.kind);
+    tokens.next(ev.subject);
+    tokens.nextInt(ev.value);
+}
+
+void parseItemArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.subject);
+    tokens.next(ev.item);
+    tokens.nextInt(ev.value);
+    ev.rest = tokens;
+}
+
+void parseCombatArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.subject);
+    tokens.next(ev.object);
+    tokens.next(ev.item);
+}
+
+void parseRepeatArgs(Tokenizer& tokens, EventRecord& ev) {
+    parseCombatArgs(tokens, ev);
+    tokens.nextInt(ev.value);
+}
+
+void parseVolleyArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.subject);
+    tokens.next(ev.item);
+    ev.rest = tokens;
+}
+
+void parseEffectArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.subject);
+    tokens.nextInt(ev.value);
+    tokens.nextInt(ev.period);
+    tokens.nextInt(ev.ticks);
+}
+
+void parseWaitArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.nextInt(ev.value);
+}
+
+void parseDrinkArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.object);
+    tokens.next(ev.subject);
+    tokens.next(ev.item);
+}
+
+void parseDialogueArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.subject);
+    tokens.nextInt(ev.value);
+    // Skip the initial space before the speech starts.
+    tokens.skipPast(' ');
+    ev.rest = tokens;
+}
+
+void parseAreaArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.kind);
+    tokens.nextInt(ev.value);
+    ev.rest = tokens;
+}
+
+void parseNoArgs(Tokenizer&, EventRecord&) {}
+
+void parseShowArgs(Tokenizer& tokens, EventRecord& ev) {
+    tokens.next(ev.subject);
+}
+
+Character* characterAt(CharacterId id) {
+    if (id == noCharacter) {
+        return nullptr;
+    }
+    Character* character = characters()[id].get();
+    return character ? character : reaper().rebuild(id);
+}
+
+Character* findCharacter(string_view name) {
+    return characterAt(characterNames().find(name));
+}
+
+Character* subjectOf(const EventRecord& ev) {
+    Character* character = ev.compiled ? characterAt(ev.subjectId) : findCharacter(ev.subject);
+    if (!character) {
+        noteOutcome(EventOutcome::UnknownCharacter);
+    }
+    return character;
+}
+
+Character* objectOf(const EventRecord& ev) {
+    Character* character = ev.compiled ? characterAt(ev.objectId) : findCharacter(ev.object);
+    if (!character) {
+        noteOutcome(EventOutcome::UnknownCharacter);
+    }
+    return character;
+}
+
+// The existing characters among the first limit names after the fixed arguments, in
+// order. Names that were never created are skipped.
+void collectTargets(const EventRecord& ev, size_t limit, vector<CharacterId>& ids) {
+    if (ev.compiled) {
+        ids.assign(ev.targetIds.begin(), ev.targetIds.end());
+        return;
+    }
+    Tokenizer names = ev.rest;
+    string_view name;
+    for (size_t i = 0; i < limit && names.next(name); ++i) {
+        CharacterId id = characterNames().find(name);
+        if (id != noCharacter) {
+            ids.push_back(id);
+        }
+    }
+}
+
+template<typename T>
+void createCharacter(string_view name, int hp) {
+    CharacterId id = characterNames().intern(name);
+    if (id == characters().size()) {
+        characters().emplace_back();
+    } else {
+        // A retired character is rebuilt so that replacing it tears it down as usual.
+        characterAt(id);
+        effects().cancel(id);
+    }
+    showIndex().remove(id);
+    characters()[id] = arena().make<T>(id, string(name), hp);
+    vitals().startGeneration(id);
+    showIndex().update(*characters()[id]);
+    if (!characters()[id]->isAlive()) {
+        characterDied(*characters()[id]);
+    }
+}
+
+constexpr KeywordMap<void (*)(string_view, int), 3> characterFactories({{
+    {"fighter", createCharacter<Fighter>},
+    {"wizard", createCharacter<Wizard>},
+    {"archer", createCharacter<Archer>},
+}});
+
+void handleCreateCharacter(const EventRecord& ev) {
+    if (auto create = characterFactories.find(ev.kind)) {
+        (*create)(ev.subject, ev.value);
+    }
+    console() << "A new " << ev.kind << " came to town, " << ev.subject << ".\n";
+}
+
+void handleCreateWeapon(const EventRecord& ev) {
+    if (Character* owner = subjectOf(ev)) {
+        owner->addItem(arena().make<Weapon>(string(ev.item), owner->getHandle(), ev.value));
+        console() << ev.subject << " just obtained a new weapon called " << ev.item << ".\n";
+    }
+}
+
+void handleCreatePotion(const EventRecord& ev) {
+    if (Character* owner = subjectOf(ev)) {
+        owner->addItem(arena().make<Potion>(string(ev.item), owner->getHandle(), ev.value));
+        console() << ev.subject << " just obtained a new potion called " << ev.item << ".\n";
+    }
+}
+
+// Sorts and deduplicates ids, given in any order, into an inline list.
+SpellTargets inlineTargets(span<const CharacterId> ids) {
+    assert(ids.size() <= SpellTargets::inlineLimit);
+    SpellTargets targets;
+    copy(ids.begin(), ids.end(), targets.ids.begin());
+    sort(targets.ids.begin(), targets.ids.begin() + ids.size());
+    targets.count = uint32_t(unique(targets.ids.begin(), targets.ids.begin() + ids.size()) - targets.ids.begin());
+    return targets;
+}
+
+// Inline when the distinct members fit, a new reference to the shared set otherwise.
+SpellTargets spellTargetsOf(vector<CharacterId> ids) {
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    if (ids.size() <= SpellTargets::inlineLimit) {
+        return inlineTargets(ids);
+    }
+    SpellTargets targets;
+    targets.shared = targetSets().intern(std::move(ids));
+    return targets;
+}
+
+// The targets for a Create item spell event. Short lists are resolved straight into
+// the spell. A long list seen before in the same words is found by its text alone,
+// without resolving every name again.
+SpellTargets spellTargets(const EventRecord& ev) {
+    // Missing names would only repeat the last one, which is already allowed.
+    size_t limit = size_t(max(ev.value, 0));
+    if (ev.compiled) {
+        if (ev.targetIds.size() <= SpellTargets::inlineLimit) {
+            return inlineTargets(ev.targetIds);
+        }
+        return spellTargetsOf(vector<CharacterId>(ev.targetIds.begin(), ev.targetIds.end()));
+    }
+    Tokenizer names = ev.rest;
+    string_view name, first;
+    size_t listed = 0;
+    for (; listed < limit && names.next(name); ++listed) {
+        if (!listed) {
+            first = name;
+        }
+    }
+    if (listed <= SpellTargets::inlineLimit) {
+        array<CharacterId, SpellTargets::inlineLimit> ids;
+        size_t found = 0;
+        names = ev.rest;
+        for (size_t i = 0; i < listed && names.next(name); ++i) {
+            CharacterId id = characterNames().find(name);
+            if (id != noCharacter) {
+                ids[found++] = id;
+            }
+        }
+        return inlineTargets(span(ids.data(), found));
+    }
+    string_view text(first.data(), name.data() + name.size() - first.data());
+    if (optional<TargetSetRef> known = targetSets().findText(text)) {
+        SpellTargets targets;
+        targets.shared = *known;
+        return targets;
+    }
+    vector<CharacterId> ids;
+    collectTargets(ev, limit, ids);
+    bool resolved = ids.size() == listed;
+    SpellTargets targets = spellTargetsOf(std::move(ids));
+    if (resolved && targets.isShared()) {
+        targetSets().rememberText(text, targets.shared);
+    }
+    return targets;
+}
+
+void handleCreateSpell(const EventRecord& ev) {
+    if (Character* owner = subjectOf(ev)) {
+        owner->addItem(arena().make<Spell>(string(ev.item), owner->getHandle(), spellTargets(ev)));
+        console() << ev.subject << " just obtained a new spell called " << ev.item << ".\n";
+    }
+}
+
+// Logs why an attack, a drink or a cast did nothing, times over for a run of them. The
+// line is only put together when the story log is text, and the event prints nothing
+// to the console.
+void reportFailure(ActionResult result, const Character& actor, string_view item, size_t times = 1) {
+    switch (result) {
+        case ActionResult::Done:
+            break;
+        case ActionResult::AttackerNotAlive:
+            noteOutcome(EventOutcome::NotAlive);
+            narrator().tell(Story::NotAliveToAttack, {actor}, times);
+            break;
+        case ActionResult::TargetNotValid:
+            noteOutcome(EventOutcome::NotAlive);
+            narrator().tell(Story::TargetNotValid, {}, times);
+            break;
+        case ActionResult::MissingWeapon:
+            noteOutcome(EventOutcome::MissingItem);
+            narrator().tell(Story::MissingWeapon, {actor, item}, times);
+            break;
+        case ActionResult::DrinkerNotAlive:
+            noteOutcome(EventOutcome::NotAlive);
+            narrator().tell(Story::NotAliveToDrink, {actor}, times);
+            break;
+        case ActionResult::MissingPotion:
+            noteOutcome(EventOutcome::MissingItem);
+            narrator().tell(Story::MissingPotion, {actor, item}, times);
+            break;
+        case ActionResult::MissingSpell:
+            noteOutcome(EventOutcome::MissingItem);
+            narrator().tell(Story::MissingSpell, {actor, item}, times);
+            break;
+    }
+}
+
+// Runs times Attack events with the same attacker, target and weapon. Blows between
+// deaths are landed and printed together, and once an attack fails the rest fail alike.
+void attackRepeatedly(Character* attacker, Character* target, string_view weapon, int times) {
+    WeaponUser* user = dynamic_cast<WeaponUser*>(attacker);
+    string line;
+    while (times > 0) {
+        int blows = times;
+        ActionResult result = user->attack(target, weapon, blows);
+        if (result != ActionResult::Done) {
+            reportFailure(result, *attacker, weapon, size_t(times));
+            return;
+        }
+        if (blows == 1) {
+            console() << attacker->getName() << " attacks " << target->getName() << " with their " << weapon << "!\n";
+        } else {
+            if (line.empty()) {
+                line.append(attacker->getName()).append(" attacks ").append(target->getName());
+                line.append(" with their ").append(weapon).append("!\n");
+            }
+            console().repeat(line, size_t(blows));
+        }
+        times -= blows;
+    }
+}
+
+void handleAttack(const EventRecord& ev) {
+    Character* attacker = subjectOf(ev);
+    Character* target = objectOf(ev);
+    if (attacker && target) {
+        attackRepeatedly(attacker, target, ev.item, 1);
+    }
+}
+
+void handleCast(const EventRecord& ev) {
+    Character* caster = subjectOf(ev);
+    Character* target = objectOf(ev);
+    if (caster && target) {
+        if (ActionResult result = dynamic_cast<SpellUser*>(caster)->castSpell(ev.item, target);
+            result != ActionResult::Done) {
+            reportFailure(result, *caster, ev.item);
+            return;
+        }
+        console() << ev.subject << " casts " << ev.item << " on " << ev.object << "!\n";
+    }
+}
+
+// Repeat attack and Repeat cast: value copies of the Attack or Cast event in one line.
+void handleRepeatAttack(const EventRecord& ev) {
+    if (ev.value <= 0) {
+        return;
+    }
+    Character* attacker = subjectOf(ev);
+    Character* target = objectOf(ev);
+    if (attacker && target) {
+        attackRepeatedly(attacker, target, ev.item, ev.value);
+    }
+}
+
+void handleRepeatCast(const EventRecord& ev) {
+    if (ev.value <= 0) {
+        return;
+    }
+    Character* caster = subjectOf(ev);
+    Character* target = objectOf(ev);
+    if (caster && target) {
+        // Casting uses the spell up, so the later casts find nothing and only print. A
+        // cast that fails keeps the spell, so the later ones fail alike.
+        if (ActionResult result = dynamic_cast<SpellUser*>(caster)->castSpell(ev.item, target);
+            result != ActionResult::Done) {
+            reportFailure(result, *caster, ev.item, size_t(ev.value));
+            return;
+        }
+        string line;
+        line.append(ev.subject).append(" casts ").append(ev.item).append(" on ").append(ev.object).append("!\n");
+        console().repeat(line, size_t(ev.value));
+    }
+}
+
+// One Attack event per listed name, in order, all with the same attacker and weapon.
+void handleVolley(const EventRecord& ev) {
+    Character* attacker = subjectOf(ev);
+    if (!attacker) {
+        return;
+    }
+    vector<CharacterId> ids;
+    collectTargets(ev, numeric_limits<size_t>::max(), ids);
+    for (CharacterId id : ids) {
+        attackRepeatedly(attacker, characterAt(id), ev.item, 1);
+    }
+}
+
+void handleDrink(const EventRecord& ev) {
+    if (Character* drinker = subjectOf(ev)) {
+        ActionResult result = dynamic_cast<PotionUser*>(drinker)->drinkPotion(ev.item, drinker);
+        if (result != ActionResult::Done) {
+            reportFailure(result, *drinker, ev.item);
+            return;
+        }
+        console() << ev.subject << " drinks " << ev.item << " from " << ev.object << ".\n";
+    }
+}
+
+void handleDialogue(const EventRecord& ev) {
+    Tokenizer words = ev.rest;
+    string_view word;
+    console() << ev.subject << ": ";
+    for (int i = 0; i < ev.value; ++i) {
+        // A missing word repeats the previous one, just like a failed `iss >> word`.
+        if (!ev.compiled) {
+            words.next(word);
+        } else if (size_t(i) < ev.words.size()) {
+            word = ev.words[i];
+        }
+        console() << word;
+        if (i < ev.value - 1) {
+            console() << ' '; // Add space between words, but not after the last word.
+        }
+    }
+    console() << '\n';
+}
+
+void handleShowCharacters(const EventRecord&) {
+    showIndex().forEach([](string_view prefix, int hp) {
+        console() << prefix << hp << ' ';
+    });
+    console() << '\n';
+}
+
+void handleShowItems(const EventRecord& ev) {
+    Character* character = subjectOf(ev);
+    if (!character) {
+        return;
+    }
+    if (ev.type == EventType::ShowWeapons) {
+        dynamic_cast<WeaponUser*>(character)->showWeapons();
+    } else if (ev.type == EventType::ShowPotions) {
+        dynamic_cast<PotionUser*>(character)->showPotions();
+    } else {
+        dynamic_cast<SpellUser*>(character)->showSpells();
+    }
+}
+
+constexpr KeywordMap<uint8_t, 4> areaSelectors({{
+    {"fighter", uint8_t(CharacterKind::Fighter)},
+    {"wizard", uint8_t(CharacterKind::Wizard)},
+    {"archer", uint8_t(CharacterKind::Archer)},
+    {"all", anyCharacterKind},
+}});
+
+// Damages or heals every living character of one kind, everyone, or the characters
+// named after "list", in one sweep over the vitals store. Deaths are narrated after
+// the sweep in character id order.
+void handleArea(const EventRecord& ev) {
+    if (ev.value <= 0) {
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::AreaAmountInvalid, {});
+        return;
+    }
+    int delta = ev.type == EventType::AreaDamage ? -ev.value : ev.value;
+    const vector<CharacterId>* deaths;
+    string targets;
+    if (ev.kind == "list") {
+        vector<CharacterId> ids;
+        collectTargets(ev, numeric_limits<size_t>::max(), ids);
+        deaths = &vitals().applyList(ids, delta);
+        targets = to_string(ids.size()) + " listed characters";
+    } else if (const uint8_t* selected = areaSelectors.find(ev.kind)) {
+        deaths = &vitals().applyArea(*selected, delta);
+        targets = *selected == anyCharacterKind ? "everyone" : "every " + string(ev.kind);
+    } else {
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::UnknownAreaTarget, {ev.kind});
+        return;
+    }
+    for (CharacterId id : *deaths) {
+        narrator().tell(Story::Died, {*characters()[id]});
+        characterDied(*characters()[id]);
+    }
+    if (showIndex().ordersByHp()) {
+        // Retired characters are dead and so not in the index.
+        for (const auto& character : characters()) {
+            if (character) {
+                healthChanged(*character);
+            }
+        }
+    } else {
+        for (CharacterId id : *deaths) {
+            healthChanged(*characters()[id]);
+        }
+    }
+    if (ev.type == EventType::AreaDamage) {
+        console() << "Area damage of " << ev.value << " hits " << targets << "!\n";
+    } else {
+        console() << "Area heal of " << ev.value << " reaches " << targets << "!\n";
+    }
+}
+
+// Poison and Regenerate: amount of damage or healing every period turns, ticks times,
+// starting period turns from now.
+void handleEffect(const EventRecord& ev) {
+    Character* target = subjectOf(ev);
+    if (!target) {
+        return;
+    }
+    if (ev.value <= 0 || ev.period <= 0 || ev.ticks <= 0) {
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::EffectInvalid, {});
+        return;
+    }
+    if (!target->isAlive()) {
+        noteOutcome(EventOutcome::NotAlive);
+        narrator().tell(Story::TargetNotValid, {});
+        return;
+    }
+    EffectWheel::Effect effect;
+    effect.kind = ev.type == EventType::Poison ? EffectWheel::Kind::Poison : EffectWheel::Kind::Regeneration;
+    effect.due = effects().now() + uint64_t(ev.period);
+    effect.target = target->getHandle();
+    effect.amount = ev.value;
+    effect.period = ev.period;
+    effect.ticks = ev.ticks;
+    effects().schedule(effect);
+    if (ev.type == EventType::Poison) {
+        console() << ev.subject << " is poisoned!\n";
+    } else {
+        console() << ev.subject << " starts to regenerate!\n";
+    }
+}
+
+// A Cast event that takes place value turns from now, unless the target dies first.
+void handleDelayCast(const EventRecord& ev) {
+    Character* caster = subjectOf(ev);
+    Character* target = objectOf(ev);
+    if (!caster || !target) {
+        return;
+    }
+    // A caster that cannot carry spells cannot own this one.
+    if (!dynamic_cast<SpellUser*>(caster)) {
+        reportFailure(ActionResult::MissingSpell, *caster, ev.item);
+        return;
+    }
+    if (ev.value <= 0) {
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::EffectInvalid, {});
+        return;
+    }
+    if (!target->isAlive()) {
+        noteOutcome(EventOutcome::NotAlive);
+        narrator().tell(Story::TargetNotValid, {});
+        return;
+    }
+    EffectWheel::Effect effect;
+    effect.kind = EffectWheel::Kind::DelayedCast;
+    effect.due = effects().now() + uint64_t(ev.value);
+    effect.target = target->getHandle();
+    effect.caster = caster->getHandle();
+    effect.spell = effects().internSpell(ev.item);
+    effects().schedule(effect);
+    console() << ev.subject << " begins casting " << ev.item << " on " << ev.object << "!\n";
+}
+
+// Runs one effect as its turn comes up and returns whether it comes due again. Targets
+// are alive: their effects are cancelled when they die.
+bool applyEffect(EffectWheel::Effect& effect) {
+    Character* target = characterAt(effect.target.id);
+    switch (effect.kind) {
+        case EffectWheel::Kind::Poison:
+            narrator().tell(Story::PoisonTick, {*target, effect.amount});
+            target->takeDamage(effect.amount);
+            break;
+        case EffectWheel::Kind::Regeneration:
+            target->heal(effect.amount);
+            narrator().tell(Story::RegenerationTick, {*target, effect.amount});
+            break;
+        case EffectWheel::Kind::DelayedCast: {
+            // A caster created again under the same name is someone else.
+            if (vitals().isCurrent(effect.caster)) {
+                Character* caster = characterAt(effect.caster.id);
+                const string& spell = effects().spellName(effect.spell);
+                SpellUser* user = dynamic_cast<SpellUser*>(caster);
+                if (ActionResult result = user ? user->castSpell(spell, target) : ActionResult::MissingSpell;
+                    result != ActionResult::Done) {
+                    reportFailure(result, *caster, spell);
+                    return false;
+                }
+                console() << caster->getName() << " casts " << spell << " on " << target->getName() << "!\n";
+            }
+            return false;
+        }
+    }
+    return --effect.ticks > 0 && target->isAlive();
+}
+
+void handleWait(const EventRecord& ev) {
+    if (ev.value <= 0) {
+        noteOutcome(EventOutcome::Rejected);
+        narrator().tell(Story::WaitInvalid, {});
+        return;
+    }
+    effects().advance(uint64_t(ev.value), applyEffect);
+    console() << "Turn " << effects().now() << " begins.\n";
+}
+
+// Fields of EventRecord an event fills in; compiled events store exactly these, in
+// this order.
+enum EventOperands : uint16_t {
+    UsesKind = 1 << 0,
+    UsesSubject = 1 << 1,
+    UsesObject = 1 << 2,
+    UsesItem = 1 << 3,
+    UsesValue = 1 << 4,
+    UsesWords = 1 << 5,       // up to value words
+    UsesTargets = 1 << 6,     // up to value character names
+    UsesAllTargets = 1 << 7,  // every remaining word, as character names
+    UsesTiming = 1 << 8,      // period and ticks
+};
+
+// Every event the simulator understands. The phrase is the verb followed by any
+// subcommand words; adding an event is one line here plus its EventType.
+struct EventSpec {
+    string_view phrase;
+    EventType type;
+    void (*parseArgs)(Tokenizer&, EventRecord&);
+    void (*handle)(const EventRecord&);
+    uint16_t operands;
+};
+
+constexpr EventSpec eventSpecs[] = {
+    {"Create character",   EventType::CreateCharacter, parseCharacterArgs, handleCreateCharacter, UsesKind | UsesSubject | UsesValue},
+    {"Create item weapon", EventType::CreateWeapon,    parseItemArgs,      handleCreateWeapon,    UsesSubject | UsesItem | UsesValue},
+    {"Create item potion", EventType::CreatePotion,    parseItemArgs,      handleCreatePotion,    UsesSubject | UsesItem | UsesValue},
+    {"Create item spell",  EventType::CreateSpell,     parseItemArgs,      handleCreateSpell,     UsesSubject | UsesItem | UsesValue | UsesTargets},
+    {"Attack",             EventType::Attack,          parseCombatArgs,    handleAttack,          UsesSubject | UsesObject | UsesItem},
+    {"Cast",               EventType::Cast,            parseCombatArgs,    handleCast,            UsesSubject | UsesObject | UsesItem},
+    {"Drink",              EventType::Drink,           parseDrinkArgs,     handleDrink,           UsesSubject | UsesObject | UsesItem},
+    {"Dialogue",           EventType::Dialogue,        parseDialogueArgs,  handleDialogue,        UsesSubject | UsesValue | UsesWords},
+    {"Show characters",    EventType::ShowCharacters,  parseNoArgs,        handleShowCharacters,  0},
+    {"Show weapons",       EventType::ShowWeapons,     parseShowArgs,      handleShowItems,       UsesSubject},
+    {"Show potions",       EventType::ShowPotions,     parseShowArgs,      handleShowItems,       UsesSubject},
+    {"Show spells",        EventType::ShowSpells,      parseShowArgs,      handleShowItems,       UsesSubject},
+    {"Area damage",        EventType::AreaDamage,      parseAreaArgs,      handleArea,            UsesKind | UsesValue | UsesAllTargets},
+    {"Area heal",          EventType::AreaHeal,        parseAreaArgs,      handleArea,            UsesKind | UsesValue | UsesAllTargets},
+    {"Repeat attack",      EventType::RepeatAttack,    parseRepeatArgs,    handleRepeatAttack,    UsesSubject | UsesObject | UsesItem | UsesValue},
+    {"Repeat cast",        EventType::RepeatCast,      parseRepeatArgs,    handleRepeatCast,      UsesSubject | UsesObject | UsesItem | UsesValue},
+    {"Volley",             EventType::Volley,          parseVolleyArgs,    handleVolley,          UsesSubject | UsesItem | UsesAllTargets},
+    {"Poison",             EventType::Poison,          parseEffectArgs,    handleEffect,          UsesSubject | UsesValue | UsesTiming},
+    {"Regenerate",         EventType::Regenerate,      parseEffectArgs,    handleEffect,          UsesSubject | UsesValue | UsesTiming},
+    {"Delay cast",         EventType::DelayCast,       parseRepeatArgs,    handleDelayCast,       UsesSubject | UsesObject | UsesItem | UsesValue},
+    {"Wait",               EventType::Wait,            parseWaitArgs,      handleWait,            UsesValue},
+};
+constexpr size_t eventSpecCount = size(eventSpecs);
+constexpr size_t maxPhraseWords = 3;
+
+constexpr size_t splitPhrase(string_view phrase, array<string_view, maxPhraseWords>& words) {
+    size_t count = 0;
+    while (!phrase.empty()) {
+        if (count == maxPhraseWords) {
+            throw logic_error("event phrase has too many words");
+        }
+        size_t space = phrase.find(' ');
+        words[count++] = phrase.substr(0, space);
+        phrase = space == string_view::npos ? string_view() : phrase.substr(space + 1);
+    }
+    return count;
+}
+
+// The distinct words used by all phrases; a word's index is its column in eventGrammar.
+struct PhraseWords {
+    array<string_view, eventSpecCount * maxPhraseWords> words{};
+    size_t count = 0;
+
+    constexpr uint8_t indexOf(string_view word) const {
+        for (size_t i = 0; i < count; ++i) {
+            if (words[i] == word) {
+                return uint8_t(i);
+            }
+        }
+        throw logic_error("word is not part of any event phrase");
+    }
+};
+
+constexpr PhraseWords collectPhraseWords() {
+    PhraseWords result;
+    for (const EventSpec& spec : eventSpecs) {
+        array<string_view, maxPhraseWords> words;
+        size_t count = splitPhrase(spec.phrase, words);
+        for (size_t i = 0; i < count; ++i) {
+            if (find(result.words.begin(), result.words.begin() + result.count, words[i]) == result.words.begin() + result.count) {
+                result.words[result.count++] = words[i];
+            }
+        }
+    }
+    return result;
+}
+
+constexpr PhraseWords phraseWords = collectPhraseWords();
+
+template<size_t... I>
+constexpr array<pair<string_view, uint8_t>, sizeof...(I)> phraseWordEntries(index_sequence<I...>) {
+    return {{{phraseWords.words[I], uint8_t(I)}...}};
+}
+
+constexpr KeywordMap<uint8_t, phraseWords.count> eventWords(phraseWordEntries(make_index_sequence<phraseWords.count>()));
+
+// Jump table over phrase prefixes: row 0 is the start of a line, a positive entry is
+// the row for the next word, -(i + 1) completes eventSpecs[i] and 0 rejects the line.
+using GrammarTable = array<array<int16_t, phraseWords.count>, eventSpecCount * maxPhraseWords + 1>;
+
+constexpr GrammarTable buildEventGrammar() {
+    GrammarTable table{};
+    int16_t rows = 1;
+    for (size_t i = 0; i < eventSpecCount; ++i) {
+        array<string_view, maxPhraseWords> words;
+        size_t count = splitPhrase(eventSpecs[i].phrase, words);
+        int16_t row = 0;
+        for (size_t w = 0; w < count; ++w) {
+            int16_t& next = table[row][phraseWords.indexOf(words[w])];
+            if (w + 1 == count) {
+                if (next != 0) {
+                    throw logic_error("event phrase is a prefix of another");
+                }
+                next = -int16_t(i + 1);
+            } else {
+                if (next < 0) {
+                    throw logic_error("event phrase is a prefix of another");
+                }
+                if (next == 0) {
+                    next = rows++;
+                }
+                row = next;
+            }
+        }
+    }
+    return table;
+}
+
+constexpr GrammarTable eventGrammar = buildEventGrammar();
+
+constexpr array<void (*)(const EventRecord&), size_t(EventType::Count)> buildEventHandlers() {
+    array<void (*)(const EventRecord&), size_t(EventType::Count)> handlers{};
+    for (const EventSpec& spec : eventSpecs) {
+        handlers[size_t(spec.type)] = spec.handle;
+    }
+    return handlers;
+}
+
+constexpr auto eventHandlers = buildEventHandlers();
+
+constexpr array<uint16_t, size_t(EventType::Count)> buildEventOperands() {
+    array<uint16_t, size_t(EventType::Count)> operands{};
+    for (const EventSpec& spec : eventSpecs) {
+        operands[size_t(spec.type)] = spec.operands;
+    }
+    return operands;
+}
+
+constexpr auto eventOperands = buildEventOperands();
+
+bool parseEvent(string_view line, EventRecord& ev) {
+    Tokenizer tokens(line);
+    int16_t row = 0;
+    for (;;) {
+        string_view word;
+        tokens.next(word);
+        const uint8_t* column = eventWords.find(word);
+        if (!column) {
+            return false;
+        }
+        int16_t next = eventGrammar[row][*column];
+        if (next == 0) {
+            return false;
+        }
+        if (next < 0) {
+            const EventSpec& spec = eventSpecs[-next - 1];
+            ev.type = spec.type;
+            spec.parseArgs(tokens, ev);
+            return true;
+        }
+        row = next;
+    }
+}
+
+// The event's phrase with '_' for spaces, as used in reports.
+string eventTypeKey(EventType type) {
+    string key = "unrecognized";
+    for (const EventSpec& spec : eventSpecs) {
+        if (spec.type == type) {
+            key = spec.phrase;
+        }
+    }
+    replace(key.begin(), key.end(), ' ', '_');
+    return key;
+}
+
+constexpr const char* outcomeKeys[] = {
+    "success", "unknown_character", "container_full", "not_alive", "unauthorized_target", "missing_item", "rejected",
+    "exception",
+};
+static_assert(size(outcomeKeys) == size_t(EventOutcome::Count));
+
+// One JSON object per line with the counts and latency of every event type seen so
+// far, and the time spent writing the story log and the output.
+void writeMetricsReport(const World& world, ostream& out) {
+    const EventMetrics& stats = world.metrics;
+    out << "{\"uptime_ms\":" << chrono::duration_cast<chrono::milliseconds>(stats.uptime()).count()
+        << ",\"events\":" << stats.events()
+        << ",\"narrator_ns\":" << world.narrator.busyTime().count()
+        << ",\"output_ns\":" << world.console.busyTime().count() << ",\"types\":{";
+    const char* separator = "";
+    for (size_t type = 0; type < size_t(EventType::Count); ++type) {
+        const EventMetrics::TypeStats& typeStats = stats.stats(EventType(type));
+        uint64_t events = typeStats.events();
+        if (!events) {
+            continue;
+        }
+        out << separator << '"' << eventTypeKey(EventType(type)) << "\":{\"events\":" << events;
+        for (size_t outcome = 0; outcome < size_t(EventOutcome::Count); ++outcome) {
+            out << ",\"" << outcomeKeys[outcome] << "\":" << typeStats.outcomes[outcome];
+        }
+        out << ",\"mean_ns\":" << typeStats.total.count() / int64_t(events)
+            << ",\"p50_ns\":" << typeStats.percentile(0.5) << ",\"p90_ns\":" << typeStats.percentile(0.9)
+            << ",\"p99_ns\":" << typeStats.percentile(0.99) << ",\"max_ns\":" << typeStats.longest.count() << '}';
+        separator = ",";
+    }
+    out << "}}" << endl;
+}
+
+// The same numbers as a table for people, one row per event type.
+void printMetricsSummary(const World& world, ostream& out) {
+    const EventMetrics& stats = world.metrics;
+    auto ms = [](chrono::nanoseconds time) { return to_string(time.count() / 1000000) + " ms"; };
+    out << "event metrics: " << stats.events() << " events; story log " << ms(world.narrator.busyTime())
+        << ", output " << ms(world.console.busyTime()) << '\n';
+    char cell[32];
+    auto column = [&](const char* format, auto value) {
+        snprintf(cell, sizeof(cell), format, value);
+        out << cell;
+    };
+    column("%-20s", "type");
+    column("%10s", "events");
+    for (const char* key : outcomeKeys) {
+        column(" %s", key);
+    }
+    for (const char* key : {"mean_ns", "p50_ns", "p99_ns", "max_ns"}) {
+        column("%10s", key);
+    }
+    out << '\n';
+    for (size_t type = 0; type < size_t(EventType::Count); ++type) {
+        const EventMetrics::TypeStats& typeStats = stats.stats(EventType(type));
+        uint64_t events = typeStats.events();
+        if (!events) {
+            continue;
+        }
+        column("%-20s", eventTypeKey(EventType(type)).c_str());
+        column("%10llu", (unsigned long long)events);
+        for (size_t outcome = 0; outcome < size_t(EventOutcome::Count); ++outcome) {
+            string format = " %" + to_string(strlen(outcomeKeys[outcome])) + "llu";
+            column(format.c_str(), (unsigned long long)typeStats.outcomes[outcome]);
+        }
+        for (uint64_t ns : {uint64_t(typeStats.total.count()) / events, typeStats.percentile(0.5),
+                            typeStats.percentile(0.99), uint64_t(typeStats.longest.count())}) {
+            column("%10llu", (unsigned long long)ns);
+        }
+        out << '\n';
+    }
+    out.flush();
+}
+
+// Runs the handler of a parsed event. Metrics builds also time it, count its outcome
+// and write a periodic report when one is due.
+void dispatchEvent(const EventRecord& ev) {
+    if constexpr (!eventMetrics) {
+        eventHandlers[size_t(ev.type)](ev);
+        reaper().afterEvent();
+    } else {
+        EventMetrics& stats = metrics();
+        stats.begin();
+        auto start = chrono::steady_clock::now();
+        try {
+            eventHandlers[size_t(ev.type)](ev);
+        } catch (...) {
+            stats.record(ev.type, chrono::steady_clock::now() - start, true);
+            throw;
+        }
+        stats.record(ev.type, chrono::steady_clock::now() - start);
+        reaper().afterEvent();
+        if (ostream* report = stats.reportDue()) {
+            writeMetricsReport(*activeWorld, *report);
+        }
+    }
+}
+
+// A line that is not an event does nothing; metrics builds count it.
+void rejectLine() {
+    if constexpr (eventMetrics) {
+        metrics().begin();
+        metrics().note(EventOutcome::Rejected);
+        metrics().record(EventType::None, chrono::nanoseconds(0));
+    }
+}
+
+void processEvent(string_view event) {
+    EventRecord ev;
+    if (parseEvent(event, ev)) {
+        dispatchEvent(ev);
+    } else {
+        rejectLine();
+    }
+}
+
+
+
+// Newline search used to split input into lines. The SIMD kernels compare 16 or 32
+// bytes against '\n' at once and pick the first hit from the movemask; the best one
+// the CPU supports is chosen once at startup.
+const char* findNewlineScalar(const char* p, const char* end) {
+    const void* hit = memchr(p, '\n', end - p);
+    return hit ? static_cast<const char*>(hit) : end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char* findNewlineSse2(const char* p, const char* end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        if (mask) {
+            return p + countr_zero(mask);
+        }
+    }
+    for (; p != end; ++p) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return end;
+}
+
+__attribute__((target("avx2")))
+const char* findNewlineAvx2(const char* p, const char* end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+        if (mask) {
+            return p + countr_zero(mask);
+        }
+    }
+    return findNewlineSse2(p, end);
+}
+#endif
+
+using NewlineFinder = const char* (*)(const char*, const char*);
+
+struct NewlineKernel {
+    const char* name;
+    NewlineFinder find;
+};
+
+NewlineKernel pickNewlineKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", findNewlineAvx2};
+    }
+    return {"sse2", findNewlineSse2};
+#else
+    return {"memchr", findNewlineScalar};
+#endif
+}
+
+const NewlineKernel newlineKernel = pickNewlineKernel();
+
+// Calls onLine for every '\n'-terminated line in [data, data + size) and returns how
+// many bytes that consumed; a trailing partial line is left for the caller.
+template<typename OnLine>
+size_t splitLines(const char* data, size_t size, NewlineFinder findNewline, OnLine&& onLine) {
+    const char* p = data;
+    const char* end = data + size;
+    for (const char* newline; (newline = findNewline(p, end)) != end; p = newline + 1) {
+        onLine(string_view(p, newline - p));
+    }
+    return p - data;
+}
+
+// Feeds every line read from fd to onLine, with getline's rules: no '\n' in the line
+// and a last line without one still counts. Regular files are memory-mapped whole and
+// split a window at a time, dropping the pages behind so that a long input does not
+// stay resident (a line still referenced is simply read back from the file); pipes
+// and terminals are read in large blocks. Returns false on a read error.
+template<typename OnLine>
+bool readLines(int fd, OnLine&& onLine, NewlineFinder findNewline = newlineKernel.find) {
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size_t size = size_t(info.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            const char* data = static_cast<const char*>(mapped);
+            size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+            size_t window = 16 << 20;
+            size_t done = 0, dropped = 0;
+            for (;;) {
+                size_t chunk = min(window, size - done);
+                size_t used = splitLines(data + done, chunk, findNewline, onLine);
+                if (done + chunk == size) {
+                    if (used < chunk) {
+                        onLine(string_view(data + done + used, chunk - used));
+                    }
+                    break;
+                }
+                if (!used) {
+                    window *= 2;  // a single line longer than the window
+                    continue;
+                }
+                done += used;
+                size_t behind = done / pageSize * pageSize;
+                madvise(const_cast<char*>(data) + dropped, behind - dropped, MADV_DONTNEED);
+                dropped = behind;
+            }
+            munmap(mapped, size);
+            return true;
+        }
+    }
+
+    vector<char> buffer(1 << 20);
+    size_t filled = 0;
+    for (;;) {
+        if (filled == buffer.size()) {
+            buffer.resize(buffer.size() * 2);  // a single line longer than the buffer
+        }
+        ssize_t got = read(fd, buffer.data() + filled, buffer.size() - filled);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (filled) {
+                onLine(string_view(buffer.data(), filled));
+            }
+            return got == 0;
+        }
+        filled += size_t(got);
+        size_t used = splitLines(buffer.data(), filled, findNewline, onLine);
+        memmove(buffer.data(), buffer.data() + used, filled - used);
+        filled -= used;
+    }
+}
+
+// Reads the same file through getline and through readLines with every available
+// newline kernel, and reports lines and throughput for each on stdout.
+int runInputBenchmark(const char* path) {
+    auto report = [](const char* name, size_t lines, size_t bytes, chrono::steady_clock::duration elapsed) {
+        double seconds = chrono::duration<double>(elapsed).count();
+        cout << name << ": " << lines << " lines, " << bytes << " bytes, "
+             << (bytes / 1e6) / seconds << " MB/s" << endl;
+    };
+
+    {
+        ifstream in(path);
+        if (!in) {
+            cerr << "cannot open " << path << endl;
+            return 1;
+        }
+        size_t lines = 0, bytes = 0;
+        auto start = chrono::steady_clock::now();
+        string line;
+        while (getline(in, line)) {
+            ++lines;
+            bytes += line.size() + 1;
+        }
+        report("getline", lines, bytes, chrono::steady_clock::now() - start);
+    }
+
+    vector<NewlineKernel> kernels = {{"memchr", findNewlineScalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    kernels.push_back({"sse2", findNewlineSse2});
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", findNewlineAvx2});
+    }
+#endif
+    for (const NewlineKernel& kernel : kernels) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            cerr << "cannot open " << path << endl;
+            return 1;
+        }
+        size_t lines = 0, bytes = 0;
+        auto start = chrono::steady_clock::now();
+        readLines(fd, [&](string_view line) {
+            ++lines;
+            bytes += line.size() + 1;
+        }, kernel.find);
+        report((string("mmap+") + kernel.name).c_str(), lines, bytes, chrono::steady_clock::now() - start);
+        close(fd);
+    }
+    return 0;
+}
+
+// Compiled scenarios. A compiled file starts with "EVB\\0", a format version, the
+// number of strings and every distinct name and word (varint length, bytes), then the
+// number of events and one record per event that parsed: its EventType as a byte,
+// followed by the operands eventSpecs lists for it. Strings are varint indexes into
+// the table, values zigzag varints and lists a varint count and that many indexes.
+// Replay does no tokenizing or keyword lookup, and resolves character names through
+// an array indexed by string instead of a hash table.
+constexpr string_view compiledMagic("EVB\0", 4);
+constexpr uint8_t compiledVersion = 1;
+
+class EventCompiler {
+    NameTable stringIds;  // string -> index in strings
+    vector<string> strings;
+    string events;
+    uint64_t eventCount = 0;
+
+    void putString(string_view text) {
+        CharacterId index = stringIds.intern(text);
+        if (index == strings.size()) {
+            strings.emplace_back(text);
+        }
+        putVarint(events, index);
+    }
+
+    // Records the words a handler would read from rest, stopping where it would run dry.
+    void putList(Tokenizer words, size_t limit) {
+        vector<string_view> list;
+        string_view word;
+        for (size_t i = 0; i < limit && words.next(word); ++i) {
+            list.push_back(word);
+        }
+        putVarint(events, list.size());
+        for (string_view item : list) {
+            putString(item);
+        }
+    }
+
+public:
+    void add(string_view line) {
+        EventRecord ev;
+        if (!parseEvent(line, ev)) {
+            return;
+        }
+        uint16_t operands = eventOperands[size_t(ev.type)];
+        events.push_back(char(ev.type));
+        if (operands & UsesKind) {
+            putString(ev.kind);
+        }
+        if (operands & UsesSubject) {
+            putString(ev.subject);
+        }
+        if (operands & UsesObject) {
+            putString(ev.object);
+        }
+        if (operands & UsesItem) {
+            putString(ev.item);
+        }
+        if (operands & UsesValue) {
+            putVarint(events, zigzag(ev.value));
+        }
+        if (operands & UsesTiming) {
+            putVarint(events, zigzag(ev.period));
+            putVarint(events, zigzag(ev.ticks));
+        }
+        if (operands & (UsesWords | UsesTargets)) {
+            putList(ev.rest, size_t(max(ev.value, 0)));
+        }
+        if (operands & UsesAllTargets) {
+            putList(ev.rest, numeric_limits<size_t>::max());
+        }
+        ++eventCount;
+    }
+
+    string finish() const {
+        string out(compiledMagic);
+        out.push_back(char(compiledVersion));
+        putVarint(out, strings.size());
+        for (const string& text : strings) {
+            putVarint(out, text.size());
+            out += text;
+        }
+        putVarint(out, eventCount);
+        return out + events;
+    }
+};
+
+// Runs a compiled file against the active world. Returns false when the data is not a
+// well-formed compiled file; the events before the damaged one have run by then.
+bool replayEvents(string_view data) {
+    ByteReader in(data);
+    if (in.bytes(compiledMagic.size()) != compiledMagic || in.byte() != compiledVersion) {
+        return false;
+    }
+    uint64_t stringCount = in.varint();
+    if (!in.ok() || stringCount > in.remaining()) {
+        return false;
+    }
+    // One spare empty slot at the end stands in for out-of-range indexes.
+    vector<string_view> strings(stringCount + 1);
+    vector<CharacterId> characterOf(stringCount + 1, noCharacter);
+    for (size_t i = 0; i < stringCount; ++i) {
+        strings[i] = in.bytes(in.varint());
+        characterOf[i] = characterNames().find(strings[i]);
+    }
+    auto index = [&] {
+        uint64_t i = in.varint();
+        if (i >= stringCount) {
+            in.fail();
+            return size_t(stringCount);
+        }
+        return size_t(i);
+    };
+    vector<CharacterId> targets;
+    vector<string_view> words;
+    uint64_t eventCount = in.varint();
+    for (uint64_t n = 0; n < eventCount && in.ok(); ++n) {
+        uint8_t type = in.byte();
+        if (type == uint8_t(EventType::None) || type >= uint8_t(EventType::Count)) {
+            return false;
+        }
+        EventRecord ev;
+        ev.type = EventType(type);
+        ev.compiled = true;
+        uint16_t operands = eventOperands[type];
+        size_t subject = stringCount;
+        if (operands & UsesKind) {
+            ev.kind = strings[index()];
+        }
+        if (operands & UsesSubject) {
+            subject = index();
+            ev.subject = strings[subject];
+            ev.subjectId = characterOf[subject];
+        }
+        if (operands & UsesObject) {
+            size_t object = index();
+            ev.object = strings[object];
+            ev.objectId = characterOf[object];
+        }
+        if (operands & UsesItem) {
+            ev.item = strings[index()];
+        }
+        if (operands & UsesValue) {
+            ev.value = unzigzag(in.varint());
+        }
+        if (operands & UsesTiming) {
+            ev.period = unzigzag(in.varint());
+            ev.ticks = unzigzag(in.varint());
+        }
+        if (operands & (UsesWords | UsesTargets | UsesAllTargets)) {
+            uint64_t count = in.varint();
+            if (count > in.remaining()) {
+                return false;
+            }
+            words.clear();
+            targets.clear();
+            for (uint64_t i = 0; i < count; ++i) {
+                size_t word = index();
+                words.push_back(strings[word]);
+                if (characterOf[word] != noCharacter) {
+                    targets.push_back(characterOf[word]);
+                }
+            }
+            ev.words = words;
+            ev.targetIds = targets;
+        }
+        if (!in.ok()) {
+            return false;
+        }
+        dispatchEvent(ev);
+        if (ev.type == EventType::CreateCharacter) {
+            characterOf[subject] = characterNames().find(ev.subject);
+        }
+    }
+    return in.ok() && in.remaining() == 0;
+}
+
+// The whole contents of fd: mapped when it is a regular file, read into memory otherwise.
+class FileContents {
+    string buffer;
+    void* mapped = nullptr;
+    size_t mappedSize = 0;
+
+public:
+    explicit FileContents(int fd) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mapped = data;
+                mappedSize = info.st_size;
+                return;
+            }
+        }
+        char block[1 << 16];
+        for (;;) {
+            ssize_t got = ::read(fd, block, sizeof(block));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            buffer.append(block, got);
+        }
+    }
+
+    FileContents(const FileContents&) = delete;
+    FileContents& operator=(const FileContents&) = delete;
+
+    string_view view() const {
+        return mapped ? string_view(static_cast<const char*>(mapped), mappedSize) : string_view(buffer);
+    }
+
+    ~FileContents() {
+        if (mapped) {
+            munmap(mapped, mappedSize);
+        }
+    }
+};
+
+// Renders a binary story log as the text log the same run would have written.
+int decodeStoryLog(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "cannot open " << path << endl;
+        return 1;
+    }
+    FileContents contents(fd);
+    close(fd);
+    ByteReader in(contents.view());
+    if (in.bytes(storyMagic.size()) != storyMagic || in.byte() != storyVersion) {
+        cerr << path << ": not a binary story log" << endl;
+        return 1;
+    }
+    vector<string_view> names;  // by character id; ids are named in increasing order
+    vector<string_view> strings;
+    vector<StoryArg> args;
+    string line;
+    OutputSink out(STDOUT_FILENO);
+    while (in.ok() && in.remaining()) {
+        uint8_t kind = in.byte();
+        if (kind == storyNameRecord) {
+            uint64_t id = in.varint();
+            string_view name = in.bytes(in.varint());
+            if (id > names.size()) {
+                in.fail();
+            } else if (id == names.size()) {
+                names.push_back(name);
+            } else {
+                names[id] = name;
+            }
+            continue;
+        }
+        if (kind == storyStringRecord) {
+            strings.push_back(in.bytes(in.varint()));
+            continue;
+        }
+        if (kind >= size_t(Story::Count)) {
+            in.fail();
+            break;
+        }
+        args.clear();
+        string_view text = storyTemplates[kind];
+        for (size_t pos = 0; in.ok() && (pos = text.find('%', pos)) != string_view::npos; pos += 2) {
+            uint64_t value = in.varint();
+            if (text[pos + 1] == 'd') {
+                args.emplace_back(unzigzag(value));
+            } else if (text[pos + 1] == 'c') {
+                if (value < names.size()) {
+                    args.emplace_back(CharacterId(value), names[value]);
+                } else {
+                    in.fail();
+                }
+            } else if (value & 1) {
+                args.emplace_back(in.bytes(value >> 1));
+            } else if (value >> 1 < strings.size()) {
+                args.emplace_back(strings[value >> 1]);
+            } else {
+                in.fail();
+            }
+        }
+        if (!in.ok()) {
+            break;
+        }
+        line.clear();
+        formatStory(line, Story(kind), args);
+        line.push_back('\n');
+        out << line;
+    }
+    if (!in.ok()) {
+        out.flush();
+        cerr << path << ": damaged record" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Runs the events read from fd, as text lines or as a compiled file.
+bool runEvents(int fd, bool compiled) {
+    if (!compiled) {
+        return readLines(fd, processEvent);
+    }
+    FileContents contents(fd);
+    return replayEvents(contents.view());
+}
+
+// Parsed text events with the lines they point into. Batches are reused, so the
+// text is reserved once and never grows while records point into it.
+struct EventBatch {
+    static constexpr size_t maxBytes = 256 * 1024;
+    static constexpr size_t maxEvents = 4096;
+    string text;
+    vector<EventRecord> events;
+
+    EventBatch() {
+        text.reserve(maxBytes);
+        events.reserve(maxEvents);
+    }
+
+    bool fits(string_view line) const {
+        return events.size() < maxEvents && line.size() <= text.capacity() - text.size();
+    }
+
+    // Only called when the line fits or the batch is empty.
+    void add(string_view line) {
+        text.reserve(line.size());
+        size_t offset = text.size();
+        text.append(line);
+        EventRecord& ev = events.emplace_back();
+        if (!parseEvent(string_view(text).substr(offset), ev)) {
+            ev.type = EventType::None;
+        }
+    }
+
+    void clear() {
+        text.clear();
+        events.clear();
+    }
+};
+
+// Reads text events from fd into batches. full receives every batch that cannot take
+// the next line, and the last one, and returns the (empty) batch to fill next.
+template<typename Full>
+bool readBatches(int fd, EventBatch* batch, Full&& full) {
+    bool ok = readLines(fd, [&](string_view line) {
+        if (!batch->fits(line) && !batch->events.empty()) {
+            batch = full(batch);
+        }
+        batch->add(line);
+    });
+    full(batch);
+    return ok;
+}
+
+// Conflict-aware parallel execution of a window of events. Events that create
+// characters, show them all or hit everyone at once, and those that would crash on a
+// character of the wrong role, are barriers and run alone on this thread. The runs of
+// events between them touch at most two characters each (plus the shared spell
+// target table for new spells), so each run is split into levels: an event goes one
+// level above the last earlier event it shares anything with, and the events of one
+// level run at once on the workers. Their output goes to per-worker captures and is
+// committed afterwards in input order, together with the Show index updates they
+// deferred, so the result is byte-identical to running them one by one. An exception
+// is rethrown at its event's turn, after everything before it was committed.
+class ParallelExecutor {
+    static constexpr size_t minParallelRun = 64;  // shorter runs are not worth waking workers
+
+    // Where an event's output sits in the capture of the worker that ran it.
+    struct Outcome {
+        uint32_t worker;
+        uint32_t consoleBegin, consoleEnd;
+        uint32_t storyBegin, storyEnd;
+        uint32_t changesBegin, changesEnd;
+        exception_ptr error;
+    };
+
+    World& world;
+    size_t workerCount;
+    unique_ptr<EventCapture[]> captures;  // one per worker, 0 is this thread
+    vector<thread> workers;
+
+    // The level being run: events order[levelNext..levelEnd) of run.
+    const EventRecord* run = nullptr;
+    vector<uint32_t> order;
+    atomic<size_t> levelNext{0};
+    size_t levelEnd = 0;
+    atomic<uint64_t> generation{0};
+    atomic<size_t> busyWorkers{0};
+    bool stopping = false;
+
+    vector<Outcome> outcomes;
+    vector<uint32_t> levels;
+    vector<uint32_t> lastLevel;  // per character, valid where stamp matches runStamp
+    vector<uint32_t> stamp;
+    uint32_t runStamp = 0;
+
+    static bool isBarrier(EventType type) {
+        return type == EventType::None || type == EventType::CreateCharacter || type == EventType::ShowCharacters
+            || type == EventType::AreaDamage || type == EventType::AreaHeal || type == EventType::Volley
+            || type == EventType::Poison || type == EventType::Regenerate || type == EventType::DelayCast
+            || type == EventType::Wait;
+    }
+
+    static bool hasObject(EventType type) {
+        return type == EventType::Attack || type == EventType::Cast || type == EventType::RepeatAttack
+            || type == EventType::RepeatCast || type == EventType::DelayCast;
+    }
+
+    // The handlers dereference the role interface without checking it. Delay cast checks,
+    // but a caster without the role is kept off the workers all the same.
+    static bool wouldCrash(const EventRecord& ev, Character* subject, Character* object) {
+        switch (ev.type) {
+            case EventType::Attack: return subject && object && !dynamic_cast<WeaponUser*>(subject);
+            case EventType::Cast: return subject && object && !dynamic_cast<SpellUser*>(subject);
+            case EventType::RepeatAttack: return ev.value > 0 && subject && object && !dynamic_cast<WeaponUser*>(subject);
+            case EventType::RepeatCast: return ev.value > 0 && subject && object && !dynamic_cast<SpellUser*>(subject);
+            case EventType::DelayCast: return subject && object && !dynamic_cast<SpellUser*>(subject);
+            case EventType::ShowWeapons: return subject && !dynamic_cast<WeaponUser*>(subject);
+            case EventType::ShowSpells: return subject && !dynamic_cast<SpellUser*>(subject);
+            default: return false;
+        }
+    }
+
+    void execute(size_t self, uint32_t index) {
+        EventCapture& capture = captures[self];
+        Outcome& outcome = outcomes[index];
+        outcome.worker = uint32_t(self);
+        outcome.consoleBegin = uint32_t(capture.consoleText.size());
+        outcome.storyBegin = uint32_t(capture.storyText.size());
+        outcome.changesBegin = uint32_t(capture.healthChanges.size());
+        try {
+            dispatchEvent(run[index]);
+        } catch (...) {
+            outcome.error = current_exception();
+        }
+        capture.console.flush();
+        outcome.consoleEnd = uint32_t(capture.consoleText.size());
+        outcome.storyEnd = uint32_t(capture.storyText.size());
+        outcome.changesEnd = uint32_t(capture.healthChanges.size());
+    }
+
+    void work(size_t self) {
+        activeCapture = &captures[self];
+        for (size_t next; (next = levelNext.fetch_add(1, memory_order_relaxed)) < levelEnd;) {
+            execute(self, order[next]);
+        }
+        activeCapture = nullptr;
+    }
+
+    void workerLoop(size_t self) {
+        activeWorld = &world;
+        for (uint64_t seen = 0;;) {
+            generation.wait(seen, memory_order_acquire);
+            seen = generation.load(memory_order_acquire);
+            if (stopping) {
+                return;
+            }
+            work(self);
+            if (busyWorkers.fetch_sub(1, memory_order_acq_rel) == 1) {
+                busyWorkers.notify_one();
+            }
+        }
+    }
+
+    void runLevel(size_t begin, size_t end) {
+        levelNext.store(begin, memory_order_relaxed);
+        levelEnd = end;
+        if (end - begin == 1 || workers.empty()) {
+            work(0);
+            return;
+        }
+        busyWorkers.store(workers.size(), memory_order_relaxed);
+        generation.fetch_add(1, memory_order_release);
+        generation.notify_all();
+        work(0);
+        for (size_t busy; (busy = busyWorkers.load(memory_order_acquire));) {
+            busyWorkers.wait(busy, memory_order_acquire);
+        }
+    }
+
+    // Runs events [begin, end) of the window, none of them a barrier.
+    void runConcurrently(span<const EventRecord> events, size_t begin, size_t end) {
+        size_t count = end - begin;
+        run = events.data() + begin;
+        outcomes.assign(count, Outcome{});
+        levels.resize(count);
+        if (lastLevel.size() < characters().size()) {
+            lastLevel.resize(characters().size());
+            stamp.resize(characters().size());
+        }
+        ++runStamp;
+        uint32_t spellLevel = 0, levelCount = 0;
+        bool spellSeen = false;
+        for (size_t i = 0; i < count; ++i) {
+            const EventRecord& ev = run[i];
+            array<CharacterId, 2> touched{characterNames().find(ev.subject), noCharacter};
+            if (hasObject(ev.type)) {
+                touched[1] = characterNames().find(ev.object);
+            }
+            uint32_t level = 0;
+            for (CharacterId id : touched) {
+                if (id != noCharacter && stamp[id] == runStamp) {
+                    level = max(level, lastLevel[id] + 1);
+                }
+            }
+            bool newSpell = ev.type == EventType::CreateSpell;
+            if (newSpell && spellSeen) {
+                level = max(level, spellLevel + 1);
+            }
+            for (CharacterId id : touched) {
+                if (id != noCharacter) {
+                    stamp[id] = runStamp;
+                    lastLevel[id] = level;
+                }
+            }
+            if (newSpell) {
+                spellSeen = true;
+                spellLevel = level;
+            }
+            levels[i] = level;
+            levelCount = max(levelCount, level + 1);
+        }
+
+        // Counting sort by level, keeping input order within a level.
+        vector<uint32_t> starts(levelCount + 1);
+        for (uint32_t level : levels) {
+            ++starts[level + 1];
+        }
+        for (size_t level = 0; level < levelCount; ++level) {
+            starts[level + 1] += starts[level];
+        }
+        order.resize(count);
+        vector<uint32_t> fill(starts.begin(), starts.end() - 1);
+        for (size_t i = 0; i < count; ++i) {
+            order[fill[levels[i]]++] = uint32_t(i);
+        }
+        for (size_t level = 0; level < levelCount; ++level) {
+            runLevel(starts[level], starts[level + 1]);
+        }
+        commit(count);
+    }
+
+    void commit(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            const Outcome& outcome = outcomes[i];
+            EventCapture& capture = captures[outcome.worker];
+            console() << string_view(capture.consoleText).substr(outcome.consoleBegin, outcome.consoleEnd - outcome.consoleBegin);
+            narrator().append(string_view(capture.storyText).substr(outcome.storyBegin, outcome.storyEnd - outcome.storyBegin));
+            for (uint32_t change = outcome.changesBegin; change < outcome.changesEnd; ++change) {
+                showIndex().update(*characters()[capture.healthChanges[change]]);
+            }
+            if (outcome.error) {
+                rethrow_exception(outcome.error);
+            }
+        }
+        for (size_t worker = 0; worker < workerCount; ++worker) {
+            captures[worker].consoleText.clear();
+            captures[worker].storyText.clear();
+            captures[worker].healthChanges.clear();
+            for (CharacterId id : captures[worker].deaths) {
+                effects().cancel(id);
+            }
+            captures[worker].deaths.clear();
+            for (const TargetSetRef& ref : captures[worker].releasedTargets) {
+                targetSets().release(ref);
+            }
+            captures[worker].releasedTargets.clear();
+        }
+    }
+
+public:
+    ParallelExecutor(World& world, unsigned threads)
+        : world(world), workerCount(max(threads, 1u)), captures(new EventCapture[workerCount]) {
+        world.arena.setShared(true);
+        for (size_t worker = 0; worker < workerCount; ++worker) {
+            captures[worker].narrator.setFormat(world.narrator.getFormat());
+        }
+        for (size_t self = 1; self < workerCount; ++self) {
+            workers.emplace_back(&ParallelExecutor::workerLoop, this, self);
+        }
+    }
+
+    ParallelExecutor(const ParallelExecutor&) = delete;
+    ParallelExecutor& operator=(const ParallelExecutor&) = delete;
+
+    void runWindow(span<const EventRecord> events) {
+        size_t runStart = 0;
+        auto flushRun = [&](size_t end) {
+            if (end - runStart >= minParallelRun && !workers.empty()) {
+                runConcurrently(events, runStart, end);
+            } else {
+                for (size_t i = runStart; i < end; ++i) {
+                    dispatchEvent(events[i]);
+                }
+            }
+        };
+        for (size_t i = 0; i < events.size(); ++i) {
+            const EventRecord& ev = events[i];
+            bool barrier = isBarrier(ev.type);
+            if (!barrier) {
+                Character* subject = findCharacter(ev.subject);
+                Character* object = hasObject(ev.type) ? findCharacter(ev.object) : nullptr;
+                barrier = wouldCrash(ev, subject, object);
+            }
+            if (!barrier) {
+                continue;
+            }
+            flushRun(i);
+            if (ev.type == EventType::None) {
+                rejectLine();
+            } else {
+                dispatchEvent(ev);
+            }
+            runStart = i + 1;
+        }
+        flushRun(events.size());
+    }
+
+    ~ParallelExecutor() {
+        stopping = true;
+        generation.fetch_add(1, memory_order_release);
+        generation.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        world.arena.setShared(false);
+    }
+};
+
+// Pipelined run of text events: a parser thread fills batches, this thread executes
+// them in input order (on the parallel workers when given an executor), and the
+// console's and narrator's background writers do the writing. A fixed set of batches
+// circulates between the two threads, which bounds memory however far ahead the
+// parser gets.
+bool runPipelined(int fd, ParallelExecutor* executor) {
+    constexpr size_t batchCount = 4;
+    SpscQueue<EventBatch*> parsed(batchCount);
+    SpscQueue<EventBatch*> recycled(batchCount);
+    vector<unique_ptr<EventBatch>> batches;
+    for (size_t i = 0; i < batchCount; ++i) {
+        batches.push_back(make_unique<EventBatch>());
+        recycled.push(batches.back().get());
+    }
+
+    bool readOk = true;
+    thread parser([&] {
+        readOk = readBatches(fd, recycled.pop(), [&](EventBatch* batch) {
+            parsed.push(batch);
+            EventBatch* next = recycled.pop();
+            next->clear();
+            return next;
+        });
+        parsed.push(nullptr);
+    });
+
+    for (EventBatch* batch = parsed.pop(); batch; batch = parsed.pop()) {
+        if (executor) {
+            executor->runWindow(batch->events);
+        } else {
+            for (const EventRecord& ev : batch->events) {
+                if (ev.type == EventType::None) {
+                    rejectLine();
+                } else {
+                    dispatchEvent(ev);
+                }
+            }
+        }
+        recycled.push(batch);
+    }
+    parser.join();
+    return readOk;
+}
+
+// Text events in windows of one batch, each run by the parallel executor.
+bool runParallel(int fd, ParallelExecutor& executor) {
+    EventBatch batch;
+    return readBatches(fd, &batch, [&](EventBatch* full) {
+        executor.runWindow(full->events);
+        full->clear();
+        return full;
+    });
+}
+
+int compileScenario(int input, const char* outputPath) {
+    EventCompiler compiler;
+    if (!readLines(input, [&](string_view line) { compiler.add(line); })) {
+        cerr << "cannot read input" << endl;
+        return 1;
+    }
+    string compiled = compiler.finish();
+    ofstream output(outputPath, ios::binary | ios::trunc);
+    if (!output.write(compiled.data(), compiled.size()) || !output.flush()) {
+        cerr << "cannot write " << outputPath << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// World snapshots. A snapshot is a header followed by fixed-size records for every
+// character (in id order) and every item they carry, the pending effects, the spell
+// target ids, the ids of the Show index in order, and one blob with all names; records
+// refer to names and to their items and targets by offset. Effects still waiting on the
+// wheel are saved in the order they will take place, so a restored world runs them on
+// the same turns. The file is written in native byte order and alignment so a restore
+// can map it and walk the records in place with no parsing.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t characterCount;
+    uint64_t itemCount;
+    uint64_t targetCount;
+    uint64_t nameBytes;
+    uint64_t showCount;
+    uint64_t charactersOffset;
+    uint64_t itemsOffset;
+    uint64_t targetsOffset;
+    uint64_t showOffset;
+    uint64_t namesOffset;
+    uint64_t turn;
+    uint64_t effectCount;
+    uint64_t effectsOffset;
+};
+
+struct SnapshotCharacter {
+    uint64_t nameOffset;
+    uint32_t nameLength;
+    int32_t hp;
+    uint64_t firstItem;
+    uint32_t itemCount;
+    uint8_t kind;  // CharacterKind
+    uint8_t padding[3];
+};
+
+struct SnapshotItem {
+    uint64_t nameOffset;
+    uint32_t nameLength;
+    int32_t value;  // damage or heal value; unused for spells
+    uint64_t firstTarget;
+    uint32_t targetCount;
+    uint8_t kind;  // ItemKind
+    uint8_t padding[3];
+};
+
+struct SnapshotEffect {
+    uint64_t due;
+    uint64_t spellOffset;  // delayed casts only
+    uint32_t spellLength;
+    uint32_t target;
+    uint32_t caster;       // delayed casts only
+    int32_t amount;
+    int32_t period;
+    int32_t ticks;
+    uint8_t kind;  // EffectWheel::Kind
+    uint8_t padding[7];
+};
+
+static_assert(sizeof(SnapshotCharacter) == 32 && sizeof(SnapshotItem) == 32 && sizeof(SnapshotEffect) == 48);
+
+constexpr char snapshotMagic[8] = {'W', 'O', 'R', 'L', 'D', 'S', 'N', 'P'};
+constexpr uint32_t snapshotVersion = 2;
+
+// Writes the active world to path. Returns false when the file cannot be written.
+bool saveSnapshot(const char* path) {
+    vector<SnapshotCharacter> records;
+    vector<SnapshotItem> items;
+    vector<CharacterId> targets;
+    string names;
+    vector<const PhysicalItem*> carried;
+    auto addName = [&](const string& name, uint64_t& offset, uint32_t& length) {
+        offset = names.size();
+        length = uint32_t(name.size());
+        names += name;
+    };
+    records.reserve(characters().size());
+    for (CharacterId id = 0; id < characters().size(); ++id) {
+        bool wasRetired = !characters()[id];
+        const Character* character = characterAt(id);
+        SnapshotCharacter record{};
+        addName(character->getName(), record.nameOffset, record.nameLength);
+        record.hp = character->getHP();
+        record.kind = uint8_t(vitals().getKind(character->getId()));
+        record.firstItem = items.size();
+        carried.clear();
+        character->collectItems(carried);
+        for (const PhysicalItem* carriedItem : carried) {
+            SnapshotItem item{};
+            addName(carriedItem->getName(), item.nameOffset, item.nameLength);
+            item.kind = uint8_t(carriedItem->getKind());
+            item.firstTarget = targets.size();
+            if (item.kind == uint8_t(ItemKind::Weapon)) {
+                item.value = static_cast<const Weapon*>(carriedItem)->getDamage();
+            } else if (item.kind == uint8_t(ItemKind::Potion)) {
+                item.value = static_cast<const Potion*>(carriedItem)->getHealValue();
+            } else {
+                const SpellTargets& allowed = static_cast<const Spell*>(carriedItem)->getAllowedTargets();
+                allowed.forEach([&](CharacterId target) { targets.push_back(target); });
+                item.targetCount = uint32_t(allowed.size());
+            }
+            items.push_back(item);
+        }
+        record.itemCount = uint32_t(items.size() - record.firstItem);
+        records.push_back(record);
+        if (wasRetired) {
+            reaper().retire(character->getHandle());
+        }
+    }
+    vector<SnapshotEffect> pending;
+    for (const EffectWheel::Effect& effect : effects().collect()) {
+        // A delayed cast whose caster was replaced would do nothing.
+        if (effect.kind == EffectWheel::Kind::DelayedCast && !vitals().isCurrent(effect.caster)) {
+            continue;
+        }
+        SnapshotEffect record{};
+        record.due = effect.due;
+        record.target = effect.target.id;
+        record.amount = effect.amount;
+        record.period = effect.period;
+        record.ticks = effect.ticks;
+        record.kind = uint8_t(effect.kind);
+        if (effect.kind == EffectWheel::Kind::DelayedCast) {
+            record.caster = effect.caster.id;
+            addName(effects().spellName(effect.spell), record.spellOffset, record.spellLength);
+        }
+        pending.push_back(record);
+    }
+
+    SnapshotHeader header{};
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.characterCount = uint32_t(records.size());
+    header.itemCount = items.size();
+    header.targetCount = targets.size();
+    header.nameBytes = names.size();
+    vector<CharacterId> shown = showIndex().order();
+    header.showCount = shown.size();
+    header.charactersOffset = sizeof(SnapshotHeader);
+    header.turn = effects().now();
+    header.effectCount = pending.size();
+    header.itemsOffset = header.charactersOffset + records.size() * sizeof(SnapshotCharacter);
+    header.effectsOffset = header.itemsOffset + items.size() * sizeof(SnapshotItem);
+    header.targetsOffset = header.effectsOffset + pending.size() * sizeof(SnapshotEffect);
+    header.showOffset = header.targetsOffset + targets.size() * sizeof(CharacterId);
+    header.namesOffset = header.showOffset + shown.size() * sizeof(CharacterId);
+
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SnapshotCharacter));
+    out.write(reinterpret_cast<const char*>(items.data()), items.size() * sizeof(SnapshotItem));
+    out.write(reinterpret_cast<const char*>(pending.data()), pending.size() * sizeof(SnapshotEffect));
+    out.write(reinterpret_cast<const char*>(targets.data()), targets.size() * sizeof(CharacterId));
+    out.write(reinterpret_cast<const char*>(shown.data()), shown.size() * sizeof(CharacterId));
+    out.write(names.data(), names.size());
+    return bool(out.flush());
+}
+
+template<typename Record>
+const Record* snapshotSection(string_view data, uint64_t offset, uint64_t count) {
+    if (offset % alignof(Record) || offset > data.size() || count > (data.size() - offset) / sizeof(Record)) {
+        return nullptr;
+    }
+    return reinterpret_cast<const Record*>(data.data() + offset);
+}
+
+// Rebuilds a snapshot into the active world, which must still be empty, in a single
+// pass over the mapped records. Returns false, leaving whatever was already rebuilt,
+// when the data is not a consistent snapshot.
+template<typename T>
+PoolPtr<Character> restoreCharacter(CharacterId id, string_view name, int hp) {
+    return arena().make<T>(id, string(name), hp);
+}
+
+// Indexed by CharacterKind.
+constexpr PoolPtr<Character> (*restoreByKind[])(CharacterId, string_view, int) = {
+    restoreCharacter<Fighter>, restoreCharacter<Wizard>, restoreCharacter<Archer>,
+};
+
+bool restoreSnapshot(string_view data) {
+    const SnapshotHeader* header = snapshotSection<SnapshotHeader>(data, 0, 1);
+    if (!header || memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) || header->version != snapshotVersion
+        || !characters().empty()) {
+        return false;
+    }
+    const SnapshotCharacter* records = snapshotSection<SnapshotCharacter>(data, header->charactersOffset, header->characterCount);
+    const SnapshotItem* items = snapshotSection<SnapshotItem>(data, header->itemsOffset, header->itemCount);
+    const SnapshotEffect* pending = snapshotSection<SnapshotEffect>(data, header->effectsOffset, header->effectCount);
+    const CharacterId* targets = snapshotSection<CharacterId>(data, header->targetsOffset, header->targetCount);
+    const CharacterId* shown = snapshotSection<CharacterId>(data, header->showOffset, header->showCount);
+    const char* names = snapshotSection<char>(data, header->namesOffset, header->nameBytes);
+    if (!records || !items || !pending || !targets || !shown || !names) {
+        return false;
+    }
+    auto nameOf = [&](uint64_t offset, uint32_t length, string_view& name) {
+        if (offset > header->nameBytes || length > header->nameBytes - offset) {
+            return false;
+        }
+        name = string_view(names + offset, length);
+        return true;
+    };
+
+    size_t count = header->characterCount;
+    characterNames().reserve(count);
+    characters().reserve(count);
+    for (size_t id = 0; id < count; ++id) {
+        const SnapshotCharacter& record = records[id];
+        string_view name;
+        if (!nameOf(record.nameOffset, record.nameLength, name) || record.kind >= size(restoreByKind)
+            || characterNames().intern(name) != id) {
+            return false;
+        }
+        characters().push_back(restoreByKind[record.kind](CharacterId(id), name, record.hp));
+        if (!characters().back()->isAlive()) {
+            characterDied(*characters().back());
+        }
+    }
+    showIndex().assign(characters(), span(shown, header->showCount));
+    for (size_t id = 0; id < count; ++id) {
+        const SnapshotCharacter& record = records[id];
+        if (record.firstItem > header->itemCount || record.itemCount > header->itemCount - record.firstItem) {
+            return false;
+        }
+        Character* owner = characters()[id].get();
+        for (const SnapshotItem& item : span(items + record.firstItem, record.itemCount)) {
+            string_view name;
+            if (!nameOf(item.nameOffset, item.nameLength, name)) {
+                return false;
+            }
+            if (item.kind == uint8_t(ItemKind::Spell)) {
+                if (item.firstTarget > header->targetCount || item.targetCount > header->targetCount - item.firstTarget) {
+                    return false;
+                }
+                vector<CharacterId> allowed(targets + item.firstTarget, targets + item.firstTarget + item.targetCount);
+                if (any_of(allowed.begin(), allowed.end(), [&](CharacterId target) { return target >= count; })) {
+                    return false;
+                }
+                owner->addItem(arena().make<Spell>(string(name), owner->getHandle(), spellTargetsOf(std::move(allowed))));
+            } else if (item.value <= 0) {
+                return false;
+            } else if (item.kind == uint8_t(ItemKind::Weapon)) {
+                owner->addItem(arena().make<Weapon>(string(name), owner->getHandle(), item.value));
+            } else if (item.kind == uint8_t(ItemKind::Potion)) {
+                owner->addItem(arena().make<Potion>(string(name), owner->getHandle(), item.value));
+            } else {
+                return false;
+            }
+        }
+    }
+    // Effects go back in the order they were saved in, which keeps their order within
+    // a turn.
+    effects().setNow(header->turn);
+    for (const SnapshotEffect& record : span(pending, header->effectCount)) {
+        EffectWheel::Effect effect;
+        if (record.due <= header->turn || record.target >= count || !characters()[record.target]->isAlive()
+            || record.kind > uint8_t(EffectWheel::Kind::DelayedCast)) {
+            return false;
+        }
+        effect.kind = EffectWheel::Kind(record.kind);
+        effect.due = record.due;
+        effect.target = characters()[record.target]->getHandle();
+        if (effect.kind == EffectWheel::Kind::DelayedCast) {
+            string_view spell;
+            if (record.caster >= count || !nameOf(record.spellOffset, record.spellLength, spell)) {
+                return false;
+            }
+            effect.caster = characters()[record.caster]->getHandle();
+            effect.spell = effects().internSpell(spell);
+        } else if (record.amount <= 0 || record.period <= 0 || record.ticks <= 0) {
+            return false;
+        }
+        effect.amount = record.amount;
+        effect.period = record.period;
+        effect.ticks = record.ticks;
+        effects().schedule(effect);
+    }
+    return true;
+}
+
+bool loadSnapshot(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    FileContents contents(fd);
+    close(fd);
+    return restoreSnapshot(contents.view());
+}
+
+CharacterReaper::~CharacterReaper() = default;
+
+void CharacterReaper::retire(CharacterHandle handle) {
+    CharacterId id = handle.id;
+    if (!vitals().isCurrent(handle) || vitals().isAlive(id) || !characters()[id]) {
+        return;
+    }
+    assert(!activeCapture);
+    // Name, kind and HP stay in the name table and vitals; only the items need keeping.
+    vector<const PhysicalItem*> carried;
+    characters()[id]->collectItems(carried);
+    if (!carried.empty()) {
+        string packed;
+        for (const PhysicalItem* item : carried) {
+            packed.push_back(char(item->getKind()));
+            putVarint(packed, item->getName().size());
+            packed += item->getName();
+            if (item->getKind() == ItemKind::Weapon) {
+                putVarint(packed, static_cast<const Weapon*>(item)->getDamage());
+            } else if (item->getKind() == ItemKind::Potion) {
+                putVarint(packed, static_cast<const Potion*>(item)->getHealValue());
+            } else {
+                // The record holds a reference of its own, as the spell lets go of its.
+                const SpellTargets& targets = static_cast<const Spell*>(item)->getAllowedTargets();
+                if (targets.isShared()) {
+                    targetSets().retain(targets.shared);
+                }
+                packed.append(reinterpret_cast<const char*>(&targets), sizeof(targets));
+            }
+        }
+        retired.insert_or_assign(id, std::move(packed));
+    }
+    // Its containers print their teardown lines when it is finally released instead.
+    if (!quiet) {
+        quiet = make_unique<EventCapture>();
+    }
+    activeCapture = quiet.get();
+    characters()[id].reset();
+    activeCapture = nullptr;
+    quiet->console.flush();
+    quiet->consoleText.clear();
+    for (const TargetSetRef& ref : quiet->releasedTargets) {
+        targetSets().release(ref);
+    }
+    quiet->releasedTargets.clear();
+}
+
+Character* CharacterReaper::rebuild(CharacterId id) {
+    assert(!activeCapture && !characters()[id]);
+    PoolPtr<Character>& slot = characters()[id];
+    slot = restoreByKind[size_t(vitals().getKind(id))](id, characterNames().nameOf(id), vitals().getHP(id));
+    Character* character = slot.get();
+    CharacterHandle handle = character->getHandle();
+    if (auto it = retired.find(id); it != retired.end()) {
+        ByteReader in(it->second);
+        while (in.remaining()) {
+            ItemKind kind = ItemKind(in.byte());
+            string name(in.bytes(in.varint()));
+            if (kind == ItemKind::Weapon) {
+                character->addItem(arena().make<Weapon>(std::move(name), handle, int(in.varint())));
+            } else if (kind == ItemKind::Potion) {
+                character->addItem(arena().make<Potion>(std::move(name), handle, int(in.varint())));
+            } else {
+                SpellTargets targets;
+                memcpy(&targets, in.bytes(sizeof(targets)).data(), sizeof(targets));
+                character->addItem(arena().make<Spell>(std::move(name), handle, targets));
+            }
+        }
+        retired.erase(it);
+    }
+    // Still dead, so it is retired again once it has gone untouched for a while.
+    noteDeath(handle);
+    return character;
+}
+
+void CharacterReaper::releaseAll() {
+    if (!grace) {
+        return;
+    }
+    for (CharacterId id = 0; id < characters().size(); ++id) {
+        if (!characters()[id]) {
+            rebuild(id);
+            characters()[id].reset();
+        }
+    }
+}
+
+// Output already produced must not be lost when an event crashes the process, so
+// fatal signals (including the abort after an uncaught exception) flush the console
+// and let the background writers catch up before the default action runs.
+void flushConsoleOnCrash() {
+    struct sigaction action {};
+    action.sa_handler = [](int signal) {
+        if (activeWorld) {
+            activeWorld->narrator.flushFromSignal();
+            activeWorld->console.flushFromSignal();
+        }
+        raise(signal);
+    };
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (int signal : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+        sigaction(signal, &action, nullptr);
+    }
+}
+
+// Runs tasks 0..count-1 on a fixed number of threads. Each worker starts with an equal
+// share of the tasks in its own deque, pops from the back of it and, once it is empty,
+// steals from the front of the others', so a few long tasks cannot leave threads idle.
+// A task is called with its number and the number of the worker running it.
+class WorkStealingPool {
+    struct alignas(64) Worker {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+    unique_ptr<Worker[]> workers;
+    size_t workerCount;
+
+    bool take(size_t self, size_t& task) {
+        {
+            lock_guard<mutex> guard(workers[self].lock);
+            if (!workers[self].tasks.empty()) {
+                task = workers[self].tasks.back();
+                workers[self].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < workerCount; ++k) {
+            Worker& victim = workers[(self + k) % workerCount];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    explicit WorkStealingPool(size_t threads) : workers(new Worker[max<size_t>(threads, 1)]), workerCount(max<size_t>(threads, 1)) {}
+
+    size_t size() const { return workerCount; }
+
+    template<typename Task>
+    void run(size_t count, Task&& task) {
+        // Hand out tasks in reverse so every worker pops its share in input order.
+        for (size_t i = count; i-- > 0;) {
+            workers[i % workerCount].tasks.push_back(i);
+        }
+        vector<thread> threads;
+        for (size_t self = 0; self < workerCount; ++self) {
+            threads.emplace_back([this, self, &task] {
+                size_t next;
+                while (take(self, next)) {
+                    task(next, self);
+                }
+            });
+        }
+        for (thread& worker : threads) {
+            worker.join();
+        }
+    }
+};
+
+mutex reportMutex;
+
+void reportScenario(const string& message) {
+    lock_guard<mutex> guard(reportMutex);
+    cerr << message << endl;
+}
+
+// Simulates one scenario file in a world of its own, writing FILE.out and FILE.log
+// (its story log) next to it, and FILE.metrics in metrics builds. An exception that
+// would terminate a single-scenario run ends only this world, with its output cut off at
+// the same point. The world takes its objects from arena, which is reset for the next
+// scenario once the world is gone.
+bool runScenario(const string& path, bool compiled, const char* snapshot, WorldArena& arena, bool poolStats) {
+    int input = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (input < 0) {
+        reportScenario("cannot open " + path);
+        return false;
+    }
+    bool ok = true;
+    try {
+        World world(path + ".log", path + ".out", &arena);
+        world.narrator.setMode(Narrator::Mode::Buffered);
+        activeWorld = &world;
+        try {
+            if (snapshot && !loadSnapshot(snapshot)) {
+                reportScenario(path + ": cannot restore " + snapshot);
+                ok = false;
+            } else if (!runEvents(input, compiled)) {
+                reportScenario(path + (compiled ? ": not a compiled scenario" : ": read error"));
+                ok = false;
+            }
+        } catch (const exception& e) {
+            // A serial run aborts here: no teardown lines follow the last event.
+            world.console.stop();
+            reportScenario(path + ": stopped by exception: " + e.what());
+            ok = false;
+        }
+        if constexpr (eventMetrics) {
+            ofstream report(path + ".metrics", ios::trunc);
+            writeMetricsReport(world, report);
+        }
+    } catch (const exception& e) {
+        reportScenario(path + ": " + e.what());
+        ok = false;
+    }
+    activeWorld = nullptr;
+    close(input);
+    if (poolStats) {
+        ostringstream stats;
+        arena.printStats(stats);
+        string text = stats.str();
+        text.pop_back();
+        reportScenario(path + " pools:\n" + text);
+    }
+    arena.reset();
+    return ok;
+}
+
+int runScenarios(const vector<const char*>& paths, unsigned jobs, bool compiled, const char* snapshot, bool poolStats) {
+    if (!jobs) {
+        jobs = max(thread::hardware_concurrency(), 1u);
+    }
+    atomic<size_t> failed{0};
+    WorkStealingPool pool(min<size_t>(jobs, paths.size()));
+    unique_ptr<WorldArena[]> arenas(new WorldArena[pool.size()]);  // one per worker, across its scenarios
+    pool.run(paths.size(), [&](size_t i, size_t worker) {
+        if (!runScenario(paths[i], compiled, snapshot, arenas[worker], poolStats)) {
+            failed.fetch_add(1, memory_order_relaxed);
+        }
+    });
+    return failed.load() ? 1 : 0;
+}
+
+// Benchmark mode. A seeded generator builds a synthetic scenario: characters of all
+// three kinds with items up to their container sizes, then a stream of events drawn
+// from the weighted mix below. A share of the events (errors, in percent) names a
+// character that does not exist or casts on a target the spell does not allow. The
+// generator tracks roles and the stock of potions and spells, which are used up, so
+// no event hits a crashing path or a missing item unless the simulator misbehaves.
+struct BenchSettings {
+    uint64_t seed = 1;
+    unsigned characters = 10000;
+    unsigned items = 3;    // per container, capped at its capacity
+    unsigned targets = 4;  // allowed targets per spell
+    unsigned errors = 5;   // percent of mix events that fail
+    size_t events = 1000000;
+    unsigned hp = 1000000;  // large enough that nobody dies of the workload
+    unsigned repeat = 3;    // passes of each kind; the fastest one is reported
+    // Relative weights of the event mix.
+    unsigned attack = 500;
+    unsigned cast = 250;
+    unsigned drink = 150;
+    unsigned dialogue = 95;
+    unsigned area = 4;
+    unsigned show = 1;
+
+    string describe() const {
+        return "bench seed=" + to_string(seed) + " characters=" + to_string(characters) + " items=" + to_string(items)
+             + " targets=" + to_string(targets) + " errors=" + to_string(errors) + " events=" + to_string(events)
+             + " hp=" + to_string(hp) + " repeat=" + to_string(repeat) + " attack=" + to_string(attack) + " cast=" + to_string(cast)
+             + " drink=" + to_string(drink) + " dialogue=" + to_string(dialogue) + " area=" + to_string(area)
+             + " show=" + to_string(show);
+    }
+};
+
+template<typename Number>
+bool parseNumber(string_view text, Number& value) {
+    auto [ptr, ec] = from_chars(text.data(), text.data() + text.size(), value);
+    return ec == errc() && ptr == text.data() + text.size();
+}
+
+// Reads "key=value,key=value" into settings; unknown keys are an error.
+bool parseBenchSettings(string_view text, BenchSettings& settings) {
+    while (!text.empty()) {
+        size_t comma = text.find(',');
+        string_view setting = text.substr(0, comma);
+        text = comma == string_view::npos ? string_view() : text.substr(comma + 1);
+        size_t equals = setting.find('=');
+        if (equals == string_view::npos) {
+            return false;
+        }
+        string_view key = setting.substr(0, equals), value = setting.substr(equals + 1);
+        bool ok = key == "seed" ? parseNumber(value, settings.seed)
+                : key == "characters" ? parseNumber(value, settings.characters)
+                : key == "items" ? parseNumber(value, settings.items)
+                : key == "targets" ? parseNumber(value, settings.targets)
+                : key == "errors" ? parseNumber(value, settings.errors) && settings.errors <= 100
+                : key == "events" ? parseNumber(value, settings.events)
+                : key == "hp" ? parseNumber(value, settings.hp) && settings.hp > 0 && settings.hp <= 1000000000
+                : key == "repeat" ? parseNumber(value, settings.repeat) && settings.repeat > 0
+                : key == "attack" ? parseNumber(value, settings.attack)
+                : key == "cast" ? parseNumber(value, settings.cast)
+                : key == "drink" ? parseNumber(value, settings.drink)
+                : key == "dialogue" ? parseNumber(value, settings.dialogue)
+                : key == "area" ? parseNumber(value, settings.area)
+                : key == "show" ? parseNumber(value, settings.show)
+                : false;
+        if (!ok) {
+            return false;
+        }
+    }
+    return settings.characters >= 3;
+}
+
+// Event lines, back to back in one buffer with a newline after each.
+struct BenchScenario {
+    string text;
+    vector<size_t> ends;  // offset just past each line's newline
+};
+
+BenchScenario generateBenchScenario(const BenchSettings& settings) {
+    BenchScenario scenario;
+    mt19937_64 random(settings.seed);
+    auto below = [&](uint64_t bound) { return bound ? random() % bound : 0; };
+    auto emit = [&](const string& line) {
+        scenario.text += line;
+        scenario.text += '\n';
+        scenario.ends.push_back(scenario.text.size());
+    };
+    auto name = [](size_t id) { return "c" + to_string(id); };
+
+    // Container sizes, by kind: weapons, potions, spells.
+    static constexpr unsigned capacity[3][3] = {{3, 5, 0}, {0, 0, 10}, {2, 3, 2}};
+    static constexpr const char* kindNames[] = {"fighter", "wizard", "archer"};
+    size_t count = settings.characters;
+    vector<unsigned> weapons(count), potions(count), spells(count);
+    vector<vector<size_t>> allowed;  // per character, spell by spell, settings.targets ids each
+    vector<size_t> fighting, casting, drinking;
+    allowed.resize(count);
+    auto addSpell = [&](size_t id, unsigned k) {
+        string line = "Create item spell " + name(id) + " s" + to_string(k) + " " + to_string(settings.targets);
+        for (unsigned t = 0; t < settings.targets; ++t) {
+            allowed[id][k * settings.targets + t] = below(count);
+            line += " " + name(allowed[id][k * settings.targets + t]);
+        }
+        emit(line);
+    };
+    for (size_t id = 0; id < count; ++id) {
+        emit("Create character " + string(kindNames[id % 3]) + " " + name(id) + " " + to_string(settings.hp));
+    }
+    for (size_t id = 0; id < count; ++id) {
+        const unsigned* caps = capacity[id % 3];
+        weapons[id] = min(settings.items, caps[0]);
+        potions[id] = min(settings.items, caps[1]);
+        spells[id] = min(settings.items, caps[2]);
+        for (unsigned k = 0; k < weapons[id]; ++k) {
+            emit("Create item weapon " + name(id) + " w" + to_string(k) + " " + to_string(1 + below(9)));
+        }
+        for (unsigned k = 0; k < potions[id]; ++k) {
+            emit("Create item potion " + name(id) + " p" + to_string(k) + " " + to_string(1 + below(9)));
+        }
+        allowed[id].resize(caps[2] * settings.targets);
+        for (unsigned k = 0; k < spells[id]; ++k) {
+            addSpell(id, k);
+        }
+        if (weapons[id]) {
+            fighting.push_back(id);
+        }
+        if (caps[2]) {
+            casting.push_back(id);
+        }
+        if (caps[1]) {
+            drinking.push_back(id);
+        }
+    }
+
+    static constexpr const char* vocabulary[] = {"the", "dragon", "sleeps", "under", "old", "mountain", "again", "tonight"};
+    const unsigned weights[] = {
+        fighting.empty() ? 0 : settings.attack, casting.empty() ? 0 : settings.cast,
+        drinking.empty() ? 0 : settings.drink, settings.dialogue, settings.area, settings.show,
+    };
+    uint64_t totalWeight = 0;
+    for (unsigned weight : weights) {
+        totalWeight += weight;
+    }
+    bool areaDamage = true;
+    for (size_t i = 0; i < settings.events && totalWeight; ++i) {
+        uint64_t pick = below(totalWeight);
+        size_t choice = 0;
+        while (pick >= weights[choice]) {
+            pick -= weights[choice++];
+        }
+        bool failing = below(100) < settings.errors;
+        string ghost = "ghost" + to_string(below(count));
+        if (choice == 0) {
+            size_t attacker = fighting[below(fighting.size())];
+            string target = failing ? ghost : name(below(count));
+            emit("Attack " + name(attacker) + " " + target + " w" + to_string(below(weapons[attacker])));
+        } else if (choice == 1) {
+            // A cast uses the spell up unless the target does not exist, so like
+            // potions the last spell is cast and restocked when none is left.
+            size_t caster = casting[below(casting.size())];
+            bool ghostTarget = failing && below(2);
+            if (!spells[caster]) {
+                addSpell(caster, 0);
+                spells[caster] = 1;
+            }
+            size_t spell = spells[caster] - 1;
+            string target;
+            if (ghostTarget) {
+                target = ghost;
+            } else if (!failing && settings.targets) {
+                target = name(allowed[caster][spell * settings.targets + below(settings.targets)]);
+            } else {
+                // Likely, not certainly, outside the allowed list.
+                target = name(below(count));
+            }
+            if (!ghostTarget) {
+                --spells[caster];
+            }
+            emit("Cast " + name(caster) + " " + target + " s" + to_string(spell));
+        } else if (choice == 2) {
+            size_t drinker = drinking[below(drinking.size())];
+            if (failing) {
+                emit("Drink " + ghost + " " + ghost + " p0");
+                continue;
+            }
+            if (!potions[drinker]) {
+                emit("Create item potion " + name(drinker) + " p0 " + to_string(1 + below(9)));
+                potions[drinker] = 1;
+            }
+            --potions[drinker];
+            emit("Drink " + name(drinker) + " " + name(drinker) + " p" + to_string(potions[drinker]));
+        } else if (choice == 3) {
+            unsigned words = 1 + below(8);
+            string line = "Dialogue " + (failing ? ghost : name(below(count))) + " " + to_string(words);
+            for (unsigned w = 0; w < words; ++w) {
+                line += " ";
+                line += vocabulary[below(size(vocabulary))];
+            }
+            emit(line);
+        } else if (choice == 4) {
+            // Alternating damage and heal of one leaves everyone's HP where it was.
+            emit(areaDamage ? "Area damage all 1" : "Area heal all 1");
+            areaDamage = !areaDamage;
+        } else {
+            emit("Show characters");
+        }
+    }
+    return scenario;
+}
+
+struct BenchTiming {
+    size_t events = 0;
+    size_t failed = 0;  // events that ended in an exception
+    chrono::nanoseconds elapsed{0};
+};
+
+// Runs the scenario in a fresh world whose output and story log go to /dev/null, on
+// objects from arena, which is reset afterwards. With perType set, every event is timed
+// on its own and charged to its type; otherwise only the whole run is, so the total
+// carries no clock overhead.
+chrono::nanoseconds runBenchPass(const BenchScenario& scenario, Narrator::Mode logMode, Narrator::Format logFormat,
+                                 BenchTiming* perType, WorldArena& arena) {
+    int sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    chrono::nanoseconds elapsed{0};
+    {
+        World world("/dev/null", sink, &arena);
+        activeWorld = &world;
+        narrator().setMode(logMode);
+        narrator().setFormat(logFormat);
+        size_t begin = 0;
+        auto start = chrono::steady_clock::now();
+        for (size_t end : scenario.ends) {
+            string_view line(scenario.text.data() + begin, end - begin - 1);
+            begin = end;
+            if (!perType) {
+                try {
+                    processEvent(line);
+                } catch (const exception&) {
+                }
+                continue;
+            }
+            EventRecord ev;
+            auto eventStart = chrono::steady_clock::now();
+            bool failed = false;
+            try {
+                if (parseEvent(line, ev)) {
+                    dispatchEvent(ev);
+                }
+            } catch (const exception&) {
+                failed = true;
+            }
+            BenchTiming& timing = perType[size_t(ev.type)];
+            timing.elapsed += chrono::steady_clock::now() - eventStart;
+            ++timing.events;
+            timing.failed += failed;
+        }
+        console().flush();
+        narrator().setMode(Narrator::Mode::Sync);
+        elapsed = chrono::steady_clock::now() - start;
+    }
+    activeWorld = nullptr;
+    close(sink);
+    arena.reset();
+    return elapsed;
+}
+
+// Report lines are "<record> key=value ..."; the first line echoes the settings.
+// Returns the value of key in the line starting with record, or -1.
+double reportValue(const vector<string>& report, string_view record, string_view key) {
+    for (const string& line : report) {
+        if (!string_view(line).starts_with(record)) {
+            continue;
+        }
+        size_t at = line.find(" " + string(key) + "=");
+        if (at == string::npos) {
+            return -1;
+        }
+        double value;
+        string_view text = string_view(line).substr(at + key.size() + 2);
+        return parseNumber(text.substr(0, text.find(' ')), value) ? value : -1;
+    }
+    return -1;
+}
+
+// Compares a report against one saved from an earlier build with the same settings.
+// Fails when total throughput, or the time per event of any type with enough samples
+// to be stable, got worse by more than tolerance percent.
+bool passesBaseline(const vector<string>& report, const char* baselinePath, double tolerance) {
+    ifstream in(baselinePath);
+    vector<string> baseline;
+    for (string line; getline(in, line);) {
+        baseline.push_back(line);
+    }
+    if (baseline.empty() || baseline[0] != report[0]) {
+        cerr << "baseline " << baselinePath << " is missing or was run with other settings" << endl;
+        return false;
+    }
+    bool pass = true;
+    auto check = [&](const string& record, string_view key, bool higherIsBetter) {
+        double now = reportValue(report, record, key), before = reportValue(baseline, record, key);
+        if (now < 0 || before <= 0) {
+            return;
+        }
+        double change = (higherIsBetter ? before / now - 1 : now / before - 1) * 100;
+        if (change > tolerance) {
+            cerr << "regression: " << record << " " << key << " " << before << " -> " << now << endl;
+            pass = false;
+        }
+    };
+    check("total", "events_per_sec", true);
+    for (const string& line : report) {
+        if (line.starts_with("type ") && reportValue(report, line.substr(0, line.find(" events=")), "events") >= 1000) {
+            check(line.substr(0, line.find(" events=")), "ns_per_event", false);
+        }
+    }
+    return pass;
+}
+
+int runBenchmark(const BenchSettings& settings, Narrator::Mode logMode, Narrator::Format logFormat, const char* baselinePath,
+                 double tolerance) {
+    BenchScenario scenario = generateBenchScenario(settings);
+    array<BenchTiming, size_t(EventType::Count)> perType{};
+    chrono::nanoseconds total = chrono::nanoseconds::max();
+    WorldArena arena;  // every pass reuses the slabs of the one before
+    for (unsigned pass = 0; pass < settings.repeat; ++pass) {
+        total = min(total, runBenchPass(scenario, logMode, logFormat, nullptr, arena));
+        array<BenchTiming, size_t(EventType::Count)> timings{};
+        runBenchPass(scenario, logMode, logFormat, timings.data(), arena);
+        for (size_t type = 0; type < perType.size(); ++type) {
+            if (!pass || timings[type].elapsed < perType[type].elapsed) {
+                perType[type] = timings[type];
+            }
+        }
+    }
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    vector<string> report;
+    report.push_back(settings.describe());
+    double seconds = chrono::duration<double>(total).count();
+    size_t events = scenario.ends.size();
+    report.push_back("total events=" + to_string(events) + " seconds=" + to_string(seconds)
+                     + " events_per_sec=" + to_string(uint64_t(events / seconds))
+                     + " ns_per_event=" + to_string(total.count() / double(events))
+                     + " peak_rss_kb=" + to_string(usage.ru_maxrss)
+                     + " scenario_kb=" + to_string(scenario.text.size() / 1024));
+    for (size_t type = 0; type < perType.size(); ++type) {
+        const BenchTiming& timing = perType[type];
+        if (!timing.events) {
+            continue;
+        }
+        report.push_back("type " + eventTypeKey(EventType(type)) + " events=" + to_string(timing.events)
+                         + " failed=" + to_string(timing.failed)
+                         + " ns_per_event=" + to_string(timing.elapsed.count() / double(timing.events)));
+    }
+    for (const string& line : report) {
+        cout << line << '\n';
+    }
+    cout.flush();
+    return !baselinePath || passesBaseline(report, baselinePath, tolerance) ? 0 : 1;
+}
+
+struct Options {
+    Narrator::Mode logMode = Narrator::Mode::Sync;
+    Narrator::FlushPolicy logPolicy;
+    Narrator::Format logFormat = Narrator::Format::Text;
+    const char* decodeLog = nullptr;  // binary story log to render
+    bool poolStats = false;
+    vector<const char*> inputs;  // stdin when empty
+    const char* inputBenchmark = nullptr;
+    bool scenarios = false;      // run every input as its own world
+    unsigned jobs = 0;           // scenario threads, 0 = one per core
+    bool replay = false;         // inputs are compiled scenarios
+    bool pipeline = false;       // parse, simulate and write on separate threads
+    unsigned parallel = 0;       // event threads for conflict-free events, 0 = serial
+    uint64_t retireDead = 0;     // events a dead character is kept for, 0 = forever
+    const char* compileOutput = nullptr;
+    const char* restorePath = nullptr;   // snapshot loaded before the first event
+    const char* snapshotPath = nullptr;  // snapshot written after the last event
+    bool benchmark = false;
+    BenchSettings benchSettings;
+    const char* benchBaseline = nullptr;  // report of an earlier run to gate against
+    double benchTolerance = 15;           // percent
+    const char* metricsReport = nullptr;  // periodic JSON reports, EVENT_METRICS builds only
+    chrono::milliseconds metricsInterval{1000};
+};
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        string_view arg = argv[i];
+        if (arg == "--async-log") {
+            options.logMode = Narrator::Mode::Async;
+        } else if (arg == "--binary-log") {
+            options.logFormat = Narrator::Format::Binary;
+        } else if (arg == "--decode-log" && i + 1 < argc) {
+            options.decodeLog = argv[++i];
+        } else if (arg == "--pool-stats") {
+            options.poolStats = true;
+        } else if (arg == "--input-bench" && i + 1 < argc) {
+            options.inputBenchmark = argv[++i];
+        } else if (arg == "--scenarios") {
+            options.scenarios = true;
+        } else if (arg == "--replay") {
+            options.replay = true;
+        } else if (arg == "--pipeline") {
+            options.pipeline = true;
+        } else if (arg == "--parallel") {
+            options.parallel = max(thread::hardware_concurrency(), 1u);
+        } else if (arg == "--compile" && i + 1 < argc) {
+            options.compileOutput = argv[++i];
+        } else if (arg == "--restore" && i + 1 < argc) {
+            options.restorePath = argv[++i];
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            options.snapshotPath = argv[++i];
+        } else if (arg == "--bench") {
+            options.benchmark = true;
+        } else if (!arg.starts_with("--")) {
+            options.inputs.push_back(argv[i]);
+        } else if (arg.starts_with("--bench=")) {
+            options.benchmark = true;
+            if (!parseBenchSettings(arg.substr(8), options.benchSettings)) {
+                return false;
+            }
+        } else if (arg.starts_with("--metrics-report=") && eventMetrics) {
+            options.metricsReport = argv[i] + 17;
+        } else if (arg.starts_with("--metrics-interval=") && eventMetrics) {
+            long long ms;
+            if (!parseNumber(arg.substr(19), ms) || ms <= 0) {
+                return false;
+            }
+            options.metricsInterval = chrono::milliseconds(ms);
+        } else if (arg.starts_with("--bench-baseline=")) {
+            options.benchBaseline = argv[i] + 17;
+        } else if (arg.starts_with("--bench-tolerance=")) {
+            if (!parseNumber(arg.substr(18), options.benchTolerance) || options.benchTolerance < 0) {
+                return false;
+            }
+        } else if (arg.starts_with("--parallel=")) {
+            if (!parseNumber(arg.substr(11), options.parallel) || !options.parallel) {
+                return false;
+            }
+        } else if (arg.starts_with("--retire-dead=")) {
+            if (!parseNumber(arg.substr(14), options.retireDead) || !options.retireDead) {
+                return false;
+            }
+        } else if (arg.starts_with("--jobs=")) {
+            if (!parseNumber(arg.substr(7), options.jobs)) {
+                return false;
+            }
+        } else if (arg.starts_with("--log-batch=")) {
+            if (!parseNumber(arg.substr(12), options.logPolicy.batchBytes)) {
+                return false;
+            }
+        } else if (arg.starts_with("--log-interval=")) {
+            long long ms;
+            if (!parseNumber(arg.substr(15), ms) || ms < 0) {
+                return false;
+            }
+            options.logPolicy.interval = chrono::milliseconds(ms);
+        } else if (arg.starts_with("--log-queue=")) {
+            if (!parseNumber(arg.substr(12), options.logPolicy.queueBytes)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    if (options.compileOutput && (options.scenarios || options.replay || options.restorePath || options.snapshotPath)) {
+        return false;
+    }
+    if (options.snapshotPath && options.scenarios) {
+        return false;
+    }
+    if (options.decodeLog) {
+        return argc == 3;
+    }
+    if (options.logFormat == Narrator::Format::Binary && (options.scenarios || options.compileOutput)) {
+        return false;
+    }
+    if ((options.pipeline || options.parallel)
+        && (options.scenarios || options.replay || options.compileOutput || options.benchmark)) {
+        return false;
+    }
+    // Metrics count every event in one place; parallel events would race on it.
+    if (options.parallel && eventMetrics) {
+        return false;
+    }
+    // Retiring and rebuilding characters happens between events on the main thread.
+    if (options.retireDead && (options.parallel || options.scenarios || options.compileOutput || options.benchmark)) {
+        return false;
+    }
+    if (options.metricsReport && (options.scenarios || options.compileOutput || options.benchmark)) {
+        return false;
+    }
+    if (options.benchmark) {
+        return options.inputs.empty() && !options.scenarios && !options.compileOutput && !options.restorePath
+            && !options.snapshotPath;
+    }
+    if (options.benchBaseline) {
+        return false;
+    }
+    return options.scenarios ? !options.inputs.empty() : options.inputs.size() <= 1;
+}
+
+// Runs the single input in the mode the options ask for.
+bool runSingle(int input, const Options& options) {
+    optional<ParallelExecutor> executor;
+    if (options.parallel) {
+        executor.emplace(*activeWorld, options.parallel);
+    }
+    if (options.pipeline) {
+        return runPipelined(input, executor ? &*executor : nullptr);
+    }
+    return executor ? runParallel(input, *executor) : runEvents(input, options.replay);
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--async-log [--log-batch=BYTES] [--log-interval=MS] [--log-queue=BYTES]] [--binary-log] [--pool-stats] [--replay | [--pipeline] [--parallel[=N]]] [--retire-dead=EVENTS] [--restore SNAPSHOT] [--snapshot OUT] [FILE]\n"
+             << "       " << argv[0] << " --scenarios [--jobs=N] [--replay] [--restore SNAPSHOT] FILE...\n"
+             << "       " << argv[0] << " --compile OUT [FILE]\n"
+             << "       " << argv[0] << " --bench[=KEY=VALUE,...] [--bench-baseline=REPORT] [--bench-tolerance=PCT] [--async-log] [--binary-log]\n"
+             << "       " << argv[0] << " --decode-log story_log.bin\n"
+             << "       " << argv[0] << " --input-bench FILE\n";
+        if (eventMetrics) {
+            cerr << "single runs also take [--metrics-report=FILE [--metrics-interval=MS]]\n";
+        }
+        cerr.flush();
+        return 1;
+    }
+    if (options.inputBenchmark) {
+        return runInputBenchmark(options.inputBenchmark);
+    }
+    if (options.decodeLog) {
+        return decodeStoryLog(options.decodeLog);
+    }
+    if (options.benchmark) {
+        return runBenchmark(options.benchSettings, options.logMode, options.logFormat, options.benchBaseline,
+                            options.benchTolerance);
+    }
+    if (options.scenarios) {
+        return runScenarios(options.inputs, options.jobs, options.replay, options.restorePath, options.poolStats);
+    }
+    const char* inputPath = options.inputs.empty() ? nullptr : options.inputs[0];
+    int input = inputPath ? open(inputPath, O_RDONLY) : STDIN_FILENO;
+    if (input < 0) {
+        cerr << "cannot open " << inputPath << endl;
+        return 1;
+    }
+    if (options.compileOutput) {
+        return compileScenario(input, options.compileOutput);
+    }
+
+    bool binaryLog = options.logFormat == Narrator::Format::Binary;
+    World world(binaryLog ? "story_log.bin" : "story_log.txt", STDOUT_FILENO);
+    activeWorld = &world;
+    narrator().setFormat(options.logFormat);
+    reaper().enable(options.retireDead);
+    if (options.pipeline) {
+        console().startWriter();
+    }
+    if (options.logMode == Narrator::Mode::Async || options.pipeline) {
+        narrator().setMode(Narrator::Mode::Async, options.logPolicy);
+        // Queued story lines must still reach the file when an exception escapes.
+        static terminate_handler previousHandler = set_terminate([] {
+            narrator().setMode(Narrator::Mode::Sync);
+            previousHandler();
+        });
+    }
+
+    // Someone watching a terminal sees each line as it happens; files and pipes get
+    // full buffers.
+    console().setLineFlush(isatty(STDOUT_FILENO));
+    flushConsoleOnCrash();
+    if (options.metricsReport && !metrics().openReport(options.metricsReport, options.metricsInterval)) {
+        cerr << "cannot write " << options.metricsReport << endl;
+        return 1;
+    }
+
+    int status = 0;
+    if (options.restorePath && !loadSnapshot(options.restorePath)) {
+        cerr << "cannot restore " << options.restorePath << endl;
+        status = 1;
+    } else if (!runSingle(input, options)) {
+        cerr << (options.replay ? "not a compiled scenario" : "read error") << endl;
+        status = 1;
+    } else if (options.snapshotPath && !saveSnapshot(options.snapshotPath)) {
+        cerr << "cannot write " << options.snapshotPath << endl;
+        status = 1;
+    }
+    if (input != STDIN_FILENO) {
+        close(input);
+    }
+    console().flush();
+    narrator().setMode(Narrator::Mode::Sync);
+    if constexpr (eventMetrics) {
+        printMetricsSummary(world, cerr);
+        if (ostream* report = metrics().finalReport()) {
+            writeMetricsReport(world, *report);
+        }
+    }
+    if (options.poolStats) {
+        arena().printStats(cerr);
+    }
+    return status;
+}